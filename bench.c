@@ -0,0 +1,779 @@
+/*
+ * mtrx - Transmit and receive audio via UDP unicast or multicast
+ * Copyright (C) 2014-2017 Vittorio Gambaletta <openwrt@vittgam.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mtrx.h"
+
+static unsigned long int iterations = 10000;
+static unsigned long int bench_plug = 1;
+// the settings tried by the loopback benchmark, comma separated lists of the -t, -k and -f values of mtx and mrx
+static char *loop_durations = "5,10,20";
+static char *loop_kbps = "128";
+static char *loop_formats = "0";
+static unsigned long int loop_max_streams = 64;
+static unsigned long int loop_seconds = 5;
+static unsigned long int loop_port = 14350;
+static signed long int loop_delay = 80;
+static unsigned long int complexity = 9;
+static unsigned long int low_delay = 0;
+
+static const char *format_names[] = {"S16", "FLOAT", "S24_3LE", "S32_LE"};
+
+extern int mtx_main(int argc, char **argv);
+extern int mrx_main(int argc, char **argv);
+
+static int64_t elapsed_ns(struct timespec *t1) {
+	struct timespec t2;
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+	return (int64_t) (t2.tv_sec - t1->tv_sec) * 1000000000 + t2.tv_nsec - t1->tv_nsec;
+}
+
+static double bench_to_float(float *out, void *in, size_t n, unsigned long int format) {
+	struct timespec t1;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	for (unsigned long int i = 0; i < iterations; i++) {
+		pcm_to_float(out, in, n, format);
+	}
+	return (double) elapsed_ns(&t1) / iterations;
+}
+
+static double bench_from_float(void *out, float *in, size_t n, unsigned long int format) {
+	struct timespec t1;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	for (unsigned long int i = 0; i < iterations; i++) {
+		pcm_from_float(out, in, n, format);
+	}
+	return (double) elapsed_ns(&t1) / iterations;
+}
+
+// what the same conversion costs when left to ALSA: float frames written to a plug PCM in front of a null device
+// that takes the given format, which never blocks; the same with a float null device is the cost of the plug
+// layer alone; returns a negative value if the PCM can't be set up
+static double bench_alsa_plug(const char *slave_format, float *pcm, snd_pcm_uframes_t samples) {
+	char conf[256];
+	snprintf(conf, sizeof(conf), "pcm.bench { type plug slave { pcm { type null } format %s } }", slave_format);
+	snd_config_t *config = NULL;
+	snd_input_t *input = NULL;
+	snd_pcm_t *snd = NULL;
+	double ret = -1;
+	if (snd_config_top(&config) < 0 || snd_input_buffer_open(&input, conf, strlen(conf)) < 0 || snd_config_load(config, input) < 0) {
+		goto out;
+	}
+	if (snd_pcm_open_lconf(&snd, "bench", SND_PCM_STREAM_PLAYBACK, SND_PCM_NONBLOCK, config) < 0) {
+		goto out;
+	}
+	if (snd_pcm_set_params(snd, SND_PCM_FORMAT_FLOAT, SND_PCM_ACCESS_RW_INTERLEAVED, channels, rate, 0, audio_packet_duration * 4) < 0) {
+		goto out;
+	}
+
+	struct timespec t1;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	for (unsigned long int i = 0; i < iterations; i++) {
+		snd_pcm_sframes_t f = snd_pcm_writei(snd, pcm, samples);
+		if (f < 0 && snd_pcm_recover(snd, f, 1) < 0) {
+			goto out;
+		}
+	}
+	ret = (double) elapsed_ns(&t1) / iterations;
+
+out:
+	if (snd) {
+		snd_pcm_close(snd);
+	}
+	if (input) {
+		snd_input_close(input);
+	}
+	if (config) {
+		snd_config_delete(config);
+	}
+	return ret;
+}
+
+// times the conversions of one frame between the wider integer formats and float, with and without the SIMD kernels,
+// checking that they give the same results
+static void bench_conv() {
+	snd_pcm_uframes_t samples = (uint64_t) audio_packet_duration * rate / 1000000;
+	size_t n = samples * channels;
+	float *pcm = malloc(n * sizeof(float));
+	float *pcm2 = malloc(n * sizeof(float));
+	int32_t *wide = malloc(n * sizeof(int32_t));
+	int32_t *wide2 = malloc(n * sizeof(int32_t));
+	if (!pcm || !pcm2 || !wide || !wide2) {
+		fprintf(stderr, "Could not allocate %lu bytes of memory!\n", (unsigned long int) n * 16);
+		exit(1);
+	}
+	// a full scale sine, slightly clipped so that the saturation is exercised too
+	for (size_t i = 0; i < n; i++) {
+		pcm[i] = 1.01f * sinf((i / channels) * 2 * M_PI * 997 / rate + (i % channels));
+	}
+
+	printf("# %lu samples of %lu channels per frame, times in ns per frame\n", samples, channels);
+	printf("# %-16s %10s %10s %8s\n", "conversion", "plain", "simd", "speedup");
+	for (unsigned long int format = SAMPLE_FORMAT_S24_3LE; format <= SAMPLE_FORMAT_S32; format++) {
+		pcm_simd = 0;
+		pcm_from_float(wide, pcm, n, format);
+		double from_plain = bench_from_float(wide, pcm, n, format);
+		double to_plain = bench_to_float(pcm2, wide, n, format);
+		pcm_simd = 1;
+		pcm_from_float(wide2, pcm, n, format);
+		double from_simd = bench_from_float(wide2, pcm, n, format);
+		if (memcmp(wide, wide2, n * pcm_sample_size(format)) != 0) {
+			printf("# float->%s: the SIMD kernel doesn't match the plain one\n", format_names[format]);
+		}
+		pcm_to_float(pcm2, wide, n, format);
+		memcpy(wide2, pcm2, n * sizeof(float));
+		double to_simd = bench_to_float(pcm2, wide, n, format);
+		pcm_simd = 0;
+		pcm_to_float(pcm2, wide, n, format);
+		pcm_simd = 1;
+		if (memcmp(wide2, pcm2, n * sizeof(float)) != 0) {
+			printf("# %s->float: the SIMD kernel doesn't match the plain one\n", format_names[format]);
+		}
+
+		char name[32];
+		snprintf(name, sizeof(name), "float->%s", format_names[format]);
+		printf("  %-16s %10.1f %10.1f %7.1fx\n", name, from_plain, from_simd, from_plain / from_simd);
+		snprintf(name, sizeof(name), "%s->float", format_names[format]);
+		printf("  %-16s %10.1f %10.1f %7.1fx\n", name, to_plain, to_simd, to_plain / to_simd);
+	}
+
+	if (bench_plug) {
+		double plug_only = bench_alsa_plug("FLOAT_LE", pcm, samples);
+		printf("# ALSA plug to a null device, float frames written, times in ns per frame\n");
+		for (unsigned long int format = SAMPLE_FORMAT_S24_3LE; format <= SAMPLE_FORMAT_S32; format++) {
+			double plug = bench_alsa_plug(format_names[format], pcm, samples);
+			if (plug < 0 || plug_only < 0) {
+				printf("# the ALSA plug PCM could not be set up\n");
+				break;
+			}
+			printf("  plug:%-11s %10.1f (%.1f without conversion)\n", format_names[format], plug, plug_only);
+		}
+	}
+
+	free(pcm);
+	free(pcm2);
+	free(wide);
+	free(wide2);
+}
+
+// times the output stage of mrx on one frame, S16 and float, with and without the SIMD kernels, with a gain
+// changing at every frame so that it is always ramping, checking that both give the same results
+static void bench_dsp() {
+	snd_pcm_uframes_t samples = (uint64_t) audio_packet_duration * rate / 1000000;
+	size_t n = samples * channels;
+	float *pcm = malloc(n * sizeof(float));
+	int16_t *pcm16 = malloc(n * sizeof(int16_t));
+	float *out = malloc(n * sizeof(float));
+	float *out2 = malloc(n * sizeof(float));
+	if (!pcm || !pcm16 || !out || !out2) {
+		fprintf(stderr, "Could not allocate %lu bytes of memory!\n", (unsigned long int) n * 14);
+		exit(1);
+	}
+	for (size_t i = 0; i < n; i++) {
+		pcm[i] = 0.9f * sinf((i / channels) * 2 * M_PI * 997 / rate + (i % channels));
+		pcm16[i] = lrintf(pcm[i] * 32767);
+	}
+
+	// the matrices apply to stereo streams, the gain alone to any
+	char *matrices[] = {NULL, "mono", "0,1;1,0"};
+	char *names[] = {"gain", "mono+gain", "swap+gain"};
+	printf("# %lu samples of %lu channels per frame, times in ns per frame\n", samples, channels);
+	printf("# %-16s %10s %10s %8s\n", "stage", "plain", "simd", "speedup");
+	for (unsigned int m = 0; m < sizeof(matrices) / sizeof(*matrices); m++) {
+		if (matrices[m] && channels != 2) {
+			continue;
+		}
+		for (int s16 = 1; s16 >= 0; s16--) {
+			double ns[2];
+			unsigned int out_channels = channels;
+			for (pcm_simd = 0; pcm_simd <= 1; pcm_simd++) {
+				struct dsp d;
+				dsp_init(&d, matrices[m], channels, samples, 1);
+				out_channels = d.out_channels;
+				void *result = pcm_simd ? out2 : out;
+				struct timespec t1;
+				clock_gettime(CLOCK_MONOTONIC, &t1);
+				for (unsigned long int i = 0; i < iterations; i++) {
+					dsp_process(&d, result, s16 ? (void *) pcm16 : (void *) pcm, samples, i & 1 ? 0.5f : 0.7f, s16);
+				}
+				ns[pcm_simd] = (double) elapsed_ns(&t1) / iterations;
+				dsp_destroy(&d);
+			}
+			pcm_simd = 1;
+			char name[32];
+			snprintf(name, sizeof(name), "%s %s", names[m], s16 ? "S16" : "float");
+			if (memcmp(out, out2, samples * out_channels * (s16 ? sizeof(int16_t) : sizeof(float))) != 0) {
+				printf("# %s: the SIMD kernels don't match the plain ones\n", name);
+			}
+			printf("  %-16s %10.1f %10.1f %7.1fx\n", name, ns[0], ns[1], ns[0] / ns[1]);
+		}
+	}
+
+	free(pcm);
+	free(pcm16);
+	free(out);
+	free(out2);
+}
+
+// a stream of the loopback benchmark: the real mtx and mrx of this binary, each in a process of its own as their
+// settings are globals, fed the signal through the stdin of mtx and drained of the audio from the stdout of mrx
+struct loop_pair {
+	pid_t tx, rx;
+	int in, out;
+	size_t written;
+	long int tx_base, rx_base;
+	char tx_stats[64], rx_stats[64];
+};
+
+// what comes out of the first mrx, with the time of each read
+struct loop_output {
+	uint8_t *data;
+	size_t len, cap;
+	int64_t *read_at;
+	size_t *read_end;
+	size_t reads, max_reads;
+};
+
+static const char *loop_tx_glitches[] = {"missed_ticks", "encode_overruns", "send_overruns", NULL};
+static const char *loop_rx_glitches[] = {"late", "concealed", "dropped", NULL};
+
+// starts main_func with the space separated args in a child process, with in and out as its stdin and stdout, on the
+// given CPU if not negative
+static pid_t loop_spawn(int (*main_func)(int argc, char **argv), char *args, int in, int out, int cpu) {
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		exit(1);
+	} else if (pid > 0) {
+		return pid;
+	}
+
+	if (cpu >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		sched_setaffinity(0, sizeof(set), &set);
+	}
+	int null = open("/dev/null", O_RDWR);
+	dup2(in >= 0 ? in : null, 0);
+	dup2(out >= 0 ? out : null, 1);
+	dup2(null, 2);
+	for (int fd = 3; fd < 1024; fd++) {
+		close(fd);
+	}
+	char *argv[32];
+	int argc = 0;
+	for (char *arg = strtok(args, " "); arg && argc < 31; arg = strtok(NULL, " ")) {
+		argv[argc++] = arg;
+	}
+	argv[argc] = NULL;
+	// getopt starts over, after the options of the benchmark
+	optind = 1;
+	exit(main_func(argc, argv));
+}
+
+// the sum of the counters in a statistics file of mtx or mrx that mean a glitch, 0 until the file is written
+static long int loop_stat(const char *path, const char **names) {
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		return 0;
+	}
+	char line[1024], name[64];
+	long int value, sum = 0;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%63s %ld", name, &value) != 2) {
+			continue;
+		}
+		for (const char **n = names; *n; n++) {
+			if (strcmp(name, *n) == 0) {
+				sum += value;
+			}
+		}
+	}
+	fclose(f);
+	return sum;
+}
+
+// reads whatever the mrx processes give until the monotonic time until, keeping the audio of the first one
+static void loop_drain(struct loop_pair *pairs, struct pollfd *pfds, unsigned long int count, struct loop_output *o, int64_t until) {
+	static uint8_t scratch[65536];
+	while (1) {
+		int64_t left = until - monotonic_now();
+		if (left <= 0) {
+			return;
+		}
+		struct timespec ts = {left / 1000000000, left % 1000000000};
+		if (ppoll(pfds, count, &ts, NULL) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("ppoll");
+			exit(1);
+		}
+		for (unsigned long int i = 0; i < count; i++) {
+			if (!pfds[i].revents) {
+				continue;
+			}
+			int first = i == 0 && o->len < o->cap && o->reads < o->max_reads;
+			ssize_t r = read(pairs[i].out, first ? o->data + o->len : scratch, first ? o->cap - o->len : sizeof(scratch));
+			if (r == 0 || (r < 0 && errno != EAGAIN)) {
+				fprintf(stderr, "mrx of stream %lu exited!\n", i);
+				exit(1);
+			}
+			if (r > 0 && first) {
+				o->len += r;
+				o->read_at[o->reads] = monotonic_now();
+				o->read_end[o->reads++] = o->len;
+			}
+		}
+	}
+}
+
+// the lag of out behind in, from min_lag to max_lag samples, where their normalized correlation over a quarter of a
+// second of audio from the middle of in is the highest, or -1 if out doesn't cover it
+static long int loop_lag(float *in, size_t in_len, float *out, size_t out_len, long int min_lag, long int max_lag, double *corr) {
+	*corr = 0;
+	size_t window = in_len / 4 < rate / 4 ? in_len / 4 : rate / 4;
+	long int start = (in_len - window) / 2;
+	long int best = -1;
+	for (long int lag = min_lag < -start ? -start : min_lag; lag <= max_lag && start + lag + window <= out_len; lag++) {
+		double xy = 0, xx = 0, yy = 0;
+		for (long int i = start; i < start + (long int) window; i++) {
+			xy += (double) in[i] * out[i + lag];
+			xx += (double) in[i] * in[i];
+			yy += (double) out[i + lag] * out[i + lag];
+		}
+		double c = xx > 0 && yy > 0 ? xy / sqrt(xx * yy) : 0;
+		if (c > *corr) {
+			*corr = c;
+			best = lag;
+		}
+	}
+	return best;
+}
+
+static int compare_double(const void *a, const void *b) {
+	return *(const double *) a < *(const double *) b ? -1 : *(const double *) a > *(const double *) b;
+}
+
+struct loop_result {
+	double e2e, corr, cpu;
+	long int lost, overruns, glitches, discontinuities;
+};
+
+// runs loop_seconds of a synthetic signal through count streams, their processes on the given CPU if not negative; the
+// signal is written to every mtx a frame at a time when a sound card would give it, so the end to end latency is how
+// long after its capture each sample comes out of the first mrx, found by correlating the two; counters are only
+// those after the first two seconds, for the pipeline to settle and the statistics files to be written
+static void loop_session(unsigned long int kbps, unsigned long int format, unsigned long int count, int cpu, int analyse, struct loop_result *res) {
+	snd_pcm_uframes_t samples = (uint64_t) audio_packet_duration * rate / 1000000;
+	int64_t clock_period = (int64_t) 1000 * audio_packet_duration;
+	size_t n = samples * channels;
+	size_t frame_size = n * pcm_sample_size(format);
+	size_t frames = (uint64_t) loop_seconds * 1000000 / audio_packet_duration;
+	size_t warmup = 2000000 / audio_packet_duration;
+	size_t len = frames * samples;
+	struct loop_pair *pairs = calloc(count, sizeof(struct loop_pair));
+	struct pollfd *pfds = calloc(count, sizeof(struct pollfd));
+	float *signal = malloc(n * sizeof(float));
+	uint8_t *captured = malloc(frames * frame_size);
+	float *in = malloc(len * sizeof(float));
+	int64_t *written_at = malloc(frames * sizeof(int64_t));
+	struct loop_output o;
+	o.cap = analyse ? (frames + 1000000 / audio_packet_duration) * frame_size : 0;
+	o.max_reads = analyse ? 4 * frames : 0;
+	o.len = o.reads = 0;
+	o.data = malloc(o.cap + 1);
+	o.read_at = malloc(o.max_reads * sizeof(int64_t) + 1);
+	o.read_end = malloc(o.max_reads * sizeof(size_t) + 1);
+	if (!pairs || !pfds || !signal || !captured || !in || !written_at || !o.data || !o.read_at || !o.read_end) {
+		fprintf(stderr, "Could not allocate %lu bytes of memory!\n", (unsigned long int) (count * (sizeof(struct loop_pair) + sizeof(struct pollfd)) + n * sizeof(float) + frames * frame_size + len * sizeof(float) + frames * sizeof(int64_t) + o.cap + o.max_reads * (sizeof(int64_t) + sizeof(size_t))));
+		exit(1);
+	}
+
+	// a logarithmic sweep from 50 Hz to 2 kHz and back every two seconds, which correlates with itself at a single lag,
+	// in quadrature on the other channels
+	double phase = 0;
+	for (size_t frame = 0; frame < frames; frame++) {
+		for (size_t i = 0; i < samples; i++) {
+			double t = fmod((double) (frame * samples + i) / rate, 2);
+			phase += 2 * M_PI * 50 * pow(40, t < 1 ? t : 2 - t) / rate;
+			for (unsigned long int c = 0; c < channels; c++) {
+				signal[i * channels + c] = 0.5 * sin(phase + c * M_PI / 2);
+			}
+			in[frame * samples + i] = signal[i * channels];
+		}
+		void *pcm = captured + frame * frame_size;
+		if (format == SAMPLE_FORMAT_S16) {
+			for (size_t i = 0; i < n; i++) {
+				((int16_t *) pcm)[i] = lrintf(signal[i] * 32767);
+			}
+		} else if (format == SAMPLE_FORMAT_FLOAT) {
+			memcpy(pcm, signal, n * sizeof(float));
+		} else {
+			pcm_from_float(pcm, signal, n, format);
+		}
+	}
+
+	// mtx drops its privileges when run as root, so the statistics go to a directory anyone can write to
+	char dir[] = "/tmp/mtrx-bench-XXXXXX";
+	if (!mkdtemp(dir) || chmod(dir, 0777)) {
+		perror("mkdtemp");
+		exit(1);
+	}
+
+	struct rusage ru1, ru2;
+	getrusage(RUSAGE_CHILDREN, &ru1);
+	int64_t started = monotonic_now();
+	char args[512];
+	int *in_pipes = malloc(count * sizeof(int));
+	if (!in_pipes) {
+		fprintf(stderr, "Could not allocate %lu bytes of memory!\n", (unsigned long int) (count * sizeof(int)));
+		exit(1);
+	}
+	for (unsigned long int i = 0; i < count; i++) {
+		struct loop_pair *p = &pairs[i];
+		int in_pipe[2], out_pipe[2];
+		if (pipe(in_pipe) || pipe(out_pipe)) {
+			perror("pipe");
+			exit(1);
+		}
+		snprintf(p->tx_stats, sizeof(p->tx_stats), "%s/tx%lu", dir, i);
+		snprintf(p->rx_stats, sizeof(p->rx_stats), "%s/rx%lu", dir, i);
+		snprintf(args, sizeof(args), "mrx -h 127.0.0.1 -p %lu -d - -f %lu -r %lu -c %lu -t %g -e %ld -S %s", loop_port + i, format, rate, channels, audio_packet_duration / 1000.0, loop_delay, p->rx_stats);
+		p->rx = loop_spawn(mrx_main, args, -1, out_pipe[1], cpu);
+		close(out_pipe[1]);
+		in_pipes[i] = in_pipe[0];
+		p->in = in_pipe[1];
+		p->out = out_pipe[0];
+		fcntl(p->in, F_SETFL, O_NONBLOCK);
+		fcntl(p->out, F_SETFL, O_NONBLOCK);
+		pfds[i].fd = p->out;
+		pfds[i].events = POLLIN;
+	}
+	loop_drain(pairs, pfds, count, &o, monotonic_now() + 500000000);
+
+	// mtx only starts with its capture, as it would otherwise make up for the ticks it waited for the first frame by
+	// stamping the frames earlier than they were captured
+	for (unsigned long int i = 0; i < count; i++) {
+		struct loop_pair *p = &pairs[i];
+		snprintf(args, sizeof(args), "mtx -h 127.0.0.1 -p %lu -d - -f %lu -r %lu -c %lu -t %g -k %lu -C %lu -l %lu -S %s", loop_port + i, format, rate, channels, audio_packet_duration / 1000.0, kbps, complexity, low_delay, p->tx_stats);
+		p->tx = loop_spawn(mtx_main, args, in_pipes[i], -1, cpu);
+		close(in_pipes[i]);
+	}
+	free(in_pipes);
+
+	// each frame is given a frame after its capture started
+	size_t out_start = o.len;
+	int64_t capture_start = monotonic_now();
+	size_t out_warm = 0;
+	long int overruns = 0;
+	for (size_t frame = 0; frame < frames; frame++) {
+		loop_drain(pairs, pfds, count, &o, capture_start + (int64_t) (frame + 1) * clock_period);
+		written_at[frame] = monotonic_now();
+		if (frame == warmup) {
+			out_warm = o.len;
+			for (unsigned long int i = 0; i < count; i++) {
+				pairs[i].tx_base = loop_stat(pairs[i].tx_stats, loop_tx_glitches);
+				pairs[i].rx_base = loop_stat(pairs[i].rx_stats, loop_rx_glitches);
+			}
+		}
+		// an mtx that doesn't keep up with the capture is one that would make the sound card overrun
+		for (unsigned long int i = 0; i < count; i++) {
+			struct loop_pair *p = &pairs[i];
+			size_t due = (frame + 1) * frame_size;
+			ssize_t r = write(p->in, captured + p->written, due - p->written);
+			if (r < 0 && errno != EAGAIN) {
+				fprintf(stderr, "mtx of stream %lu exited!\n", i);
+				exit(1);
+			}
+			p->written += r > 0 ? r : 0;
+			if (p->written < due && frame >= warmup) {
+				overruns++;
+			}
+		}
+	}
+
+	res->lost = 0;
+	res->overruns = overruns;
+	for (unsigned long int i = 0; i < count; i++) {
+		struct loop_pair *p = &pairs[i];
+		long int rx = loop_stat(p->rx_stats, loop_rx_glitches) - p->rx_base;
+		res->lost += i == 0 ? rx : 0;
+		res->overruns += loop_stat(p->tx_stats, loop_tx_glitches) - p->tx_base + (i > 0 ? rx : 0);
+		kill(p->tx, SIGTERM);
+		kill(p->rx, SIGTERM);
+	}
+	for (unsigned long int i = 0; i < count; i++) {
+		struct loop_pair *p = &pairs[i];
+		waitpid(p->tx, NULL, 0);
+		waitpid(p->rx, NULL, 0);
+		close(p->in);
+		close(p->out);
+		unlink(p->tx_stats);
+		unlink(p->rx_stats);
+		strcat(p->tx_stats, ".tmp");
+		strcat(p->rx_stats, ".tmp");
+		unlink(p->tx_stats);
+		unlink(p->rx_stats);
+	}
+	rmdir(dir);
+	getrusage(RUSAGE_CHILDREN, &ru2);
+	int64_t cpu_ns = (int64_t) (ru2.ru_utime.tv_sec + ru2.ru_stime.tv_sec - ru1.ru_utime.tv_sec - ru1.ru_stime.tv_sec) * 1000000000 + (int64_t) (ru2.ru_utime.tv_usec + ru2.ru_stime.tv_usec - ru1.ru_utime.tv_usec - ru1.ru_stime.tv_usec) * 1000;
+	res->cpu = (double) cpu_ns * 100 / (monotonic_now() - started) / count;
+
+	// the output is in frames of mrx from its start, so out_start samples were out before the capture started; frames
+	// whose error is ten times the median one are glitches, and steps of the error at the frame boundaries
+	// discontinuities
+	res->e2e = -1;
+	res->corr = 0;
+	res->glitches = res->discontinuities = 0;
+	size_t out_len = o.len / (frame_size / samples);
+	float *out = malloc(out_len * sizeof(float) + 1);
+	double *errors = malloc((out_len / samples + 1) * sizeof(double));
+	if (!out || !errors) {
+		fprintf(stderr, "Could not allocate %lu bytes of memory!\n", (unsigned long int) (out_len * sizeof(float) + (out_len / samples + 1) * sizeof(double)));
+		exit(1);
+	}
+	for (size_t i = 0; i < out_len; i++) {
+		uint8_t *pcm = o.data + i * (frame_size / samples);
+		if (format == SAMPLE_FORMAT_S16) {
+			out[i] = *(int16_t *) pcm / 32768.0f;
+		} else if (format == SAMPLE_FORMAT_FLOAT) {
+			out[i] = *(float *) pcm;
+		} else {
+			pcm_to_float(&out[i], pcm, 1, format);
+		}
+	}
+	long int first = out_start / (frame_size / samples);
+	long int lag = analyse ? loop_lag(in, len, out, out_len, first, first + (loop_delay + 500) * (long int) rate / 1000, &res->corr) : -1;
+	if (lag >= 0) {
+		double latency = 0;
+		size_t latencies = 0;
+		for (size_t r = 1; r < o.reads; r++) {
+			long int j = (long int) (o.read_end[r - 1] / (frame_size / samples)) - lag;
+			if (o.read_end[r - 1] < out_warm || j < 0 || j >= (long int) len) {
+				continue;
+			}
+			int64_t captured_at = written_at[j / samples] - clock_period + (int64_t) (j % samples) * 1000000000 / rate;
+			latency += o.read_at[r] - captured_at;
+			latencies++;
+		}
+		res->e2e = latencies ? latency / latencies / 1000000 : -1;
+
+		size_t error_count = 0;
+		for (size_t frame = (out_warm / frame_size) + 1; (frame + 1) * samples <= out_len && (long int) ((frame + 1) * samples) - lag <= (long int) len; frame++) {
+			if ((long int) (frame * samples) <= lag) {
+				continue;
+			}
+			double err = 0, sig = 0;
+			for (size_t i = frame * samples; i < (frame + 1) * samples; i++) {
+				err += (out[i] - in[i - lag]) * (out[i] - in[i - lag]);
+				sig += in[i - lag] * in[i - lag];
+			}
+			errors[error_count++] = sig > 0 ? err / sig : 0;
+			size_t i = frame * samples;
+			if (fabsf((out[i] - in[i - lag]) - (out[i - 1] - in[i - 1 - lag])) > 0.1f) {
+				res->discontinuities++;
+			}
+		}
+		if (error_count) {
+			double *sorted = malloc(error_count * sizeof(double));
+			if (!sorted) {
+				fprintf(stderr, "Could not allocate %lu bytes of memory!\n", (unsigned long int) (error_count * sizeof(double)));
+				exit(1);
+			}
+			memcpy(sorted, errors, error_count * sizeof(double));
+			qsort(sorted, error_count, sizeof(double), compare_double);
+			double median = sorted[error_count / 2];
+			for (size_t i = 0; i < error_count; i++) {
+				if (errors[i] > 0.01 && errors[i] > 10 * median) {
+					res->glitches++;
+				}
+			}
+			free(sorted);
+		}
+	}
+
+	free(pairs);
+	free(pfds);
+	free(signal);
+	free(captured);
+	free(in);
+	free(written_at);
+	free(o.data);
+	free(o.read_at);
+	free(o.read_end);
+	free(out);
+	free(errors);
+}
+
+// the most streams that one core takes without a lost frame or an overrun, doubling them until one shows up and then
+// bisecting, up to loop_max_streams
+static unsigned long int loop_max(unsigned long int kbps, unsigned long int format, int cpu, int *capped) {
+	unsigned long int good = 0, bad = 0;
+	struct loop_result res;
+	for (unsigned long int count = 1; !bad; count = count * 2 < loop_max_streams ? count * 2 : loop_max_streams) {
+		loop_session(kbps, format, count, cpu, 0, &res);
+		if (res.lost || res.overruns) {
+			bad = count;
+		} else if ((good = count) == loop_max_streams) {
+			break;
+		}
+	}
+	while (bad && bad - good > 1) {
+		unsigned long int count = (good + bad) / 2;
+		loop_session(kbps, format, count, cpu, 0, &res);
+		if (res.lost || res.overruns) {
+			bad = count;
+		} else {
+			good = count;
+		}
+	}
+	*capped = !bad;
+	return good;
+}
+
+// runs the loopback benchmark for every combination of the frame durations, bitrates and sample formats given; the
+// streams looking for the most of them all go to the last CPU the benchmark may use, which it then leaves to them
+static void bench_loop() {
+	cpu_set_t set;
+	int cpu = -1;
+	if (loop_max_streams && sched_getaffinity(0, sizeof(set), &set) == 0) {
+		for (int i = 0; i < CPU_SETSIZE; i++) {
+			if (CPU_ISSET(i, &set)) {
+				cpu = i;
+			}
+		}
+		if (CPU_COUNT(&set) > 1) {
+			CPU_CLR(cpu, &set);
+			sched_setaffinity(0, sizeof(set), &set);
+		}
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("# mtx and mrx over loopback UDP, %lu channels at %lu Hz, %lu s runs, %ld ms of delay, complexity %lu%s\n", channels, rate, loop_seconds, loop_delay, complexity, low_delay ? ", low delay" : "");
+	printf("# latency in ms, CPU time of each mtx and mrx pair in %% of one core, most pairs one core takes%s\n", cpu >= 0 ? "" : " (not looked for)");
+	printf("# %6s %5s %-8s %8s %6s %6s %7s %6s %6s %6s %7s\n", "ms", "kbps", "format", "e2e", "corr", "lost", "overrun", "glitch", "discon", "cpu_%", "streams");
+	for (char *t = loop_durations, *t_end; *t; t = t_end + (*t_end == ',')) {
+		audio_packet_duration = lrint(strtod(t, &t_end) * 1000);
+		if (t_end == t || audio_packet_duration == 0) {
+			fprintf(stderr, "Invalid frame durations %s.\n", loop_durations);
+			exit(1);
+		}
+		for (char *k = loop_kbps, *k_end; *k; k = k_end + (*k_end == ',')) {
+			unsigned long int kbps = strtoul(k, &k_end, 10);
+			if (k_end == k || kbps == 0) {
+				fprintf(stderr, "Invalid bitrates %s.\n", loop_kbps);
+				exit(1);
+			}
+			for (char *f = loop_formats, *f_end; *f; f = f_end + (*f_end == ',')) {
+				unsigned long int format = strtoul(f, &f_end, 10);
+				if (f_end == f || format > SAMPLE_FORMAT_S32) {
+					fprintf(stderr, "Invalid sample formats %s.\n", loop_formats);
+					exit(1);
+				}
+				struct loop_result res;
+				loop_session(kbps, format, 1, -1, 1, &res);
+				char e2e[16] = "?", streams[16] = "-";
+				if (res.e2e >= 0) {
+					snprintf(e2e, sizeof(e2e), "%.2f", res.e2e);
+				}
+				if (cpu >= 0) {
+					int capped;
+					unsigned long int max = loop_max(kbps, format, cpu, &capped);
+					snprintf(streams, sizeof(streams), "%s%lu", capped ? ">=" : "", max);
+				}
+				printf("  %6g %5lu %-8s %8s %6.3f %6ld %7ld %6ld %6ld %6.2f %7s\n", audio_packet_duration / 1000.0, kbps, format_names[format], e2e, res.corr, res.lost, res.overruns, res.glitches, res.discontinuities, res.cpu, streams);
+				fflush(stdout);
+			}
+		}
+	}
+}
+
+int main(int argc, char *argv[]) {
+	fprintf(stderr, "mtrx bench - Measure the cost of the processing stages\n");
+	fprintf(stderr, "Copyright (C) 2014-2017 Vittorio Gambaletta <openwrt@vittgam.net>\n\n");
+
+	while (1) {
+		int c = getopt(argc, argv, "r:c:t:n:P:k:f:s:T:e:p:C:l:");
+		if (c == -1) {
+			break;
+		} else if (c == 'r') {
+			rate = strtoul(optarg, NULL, 10);
+		} else if (c == 'c') {
+			channels = strtoul(optarg, NULL, 10);
+		} else if (c == 't') {
+			audio_packet_duration = lrint(strtod(optarg, NULL) * 1000);
+			loop_durations = optarg;
+		} else if (c == 'n') {
+			iterations = strtoul(optarg, NULL, 10);
+		} else if (c == 'P') {
+			bench_plug = strtoul(optarg, NULL, 10);
+		} else if (c == 'k') {
+			loop_kbps = optarg;
+		} else if (c == 'f') {
+			loop_formats = optarg;
+		} else if (c == 's') {
+			loop_max_streams = strtoul(optarg, NULL, 10);
+		} else if (c == 'T') {
+			loop_seconds = strtoul(optarg, NULL, 10);
+		} else if (c == 'e') {
+			loop_delay = strtol(optarg, NULL, 10);
+		} else if (c == 'p') {
+			loop_port = strtoul(optarg, NULL, 10);
+		} else if (c == 'C') {
+			complexity = strtoul(optarg, NULL, 10);
+		} else if (c == 'l') {
+			low_delay = strtoul(optarg, NULL, 10);
+		} else {
+			optind = argc + 1;
+			break;
+		}
+	}
+
+	if (optind == argc - 1 && strcmp(argv[optind], "conv") == 0 && iterations > 0) {
+		bench_conv();
+		return 0;
+	} else if (optind == argc - 1 && strcmp(argv[optind], "dsp") == 0 && iterations > 0) {
+		bench_dsp();
+		return 0;
+	} else if (optind == argc - 1 && strcmp(argv[optind], "loop") == 0 && loop_seconds > 2) {
+		bench_loop();
+		return 0;
+	}
+
+	fprintf(stderr, "\nUsage: mtrx bench [<options>] conv|dsp|loop\n\n");
+	fprintf(stderr, "    conv        Time the sample format conversions, with and without SIMD, and through the ALSA plug layer\n");
+	fprintf(stderr, "    dsp         Time the output stage of mrx, with and without SIMD\n");
+	fprintf(stderr, "    loop        Send a test signal through mtx and mrx over loopback UDP, measuring latency, glitches, CPU time and how many streams one core takes\n\n");
+	fprintf(stderr, "    -r <rate>   Sample rate (default: %lu Hz)\n", rate);
+	fprintf(stderr, "    -c <n>      Number of channels (default: %lu)\n", channels);
+	fprintf(stderr, "    -t <ms>     Frame duration, a comma separated list for loop (default: %g ms, loop: %s)\n", audio_packet_duration / 1000.0, loop_durations);
+	fprintf(stderr, "    -n <n>      Frames processed per measurement (default: %lu)\n", iterations);
+	fprintf(stderr, "    -P <n>      Also time the ALSA plug layer (default: %lu)\n", bench_plug);
+	fprintf(stderr, "    -k <kbps>   Network bitrates tried by loop, comma separated (default: %s)\n", loop_kbps);
+	fprintf(stderr, "    -f <n>      Sample formats tried by loop, comma separated, as -f of mtx and mrx (default: %s)\n", loop_formats);
+	fprintf(stderr, "    -s <n>      Most streams tried by loop on one core, 0 not to look for how many it takes (default: %lu)\n", loop_max_streams);
+	fprintf(stderr, "    -T <s>      Seconds of audio of each loop run, more than 2 (default: %lu s)\n", loop_seconds);
+	fprintf(stderr, "    -e <ms>     Total delay of mrx in loop (default: %ld ms)\n", loop_delay);
+	fprintf(stderr, "    -p <port>   First UDP port used by loop, one for each stream (default: %lu)\n", loop_port);
+	fprintf(stderr, "    -C <n>      Opus encoder complexity, 0 to 10 (default: %lu)\n", complexity);
+	fprintf(stderr, "    -l <n>      Use the restricted low delay mode of Opus (default: %lu)\n", low_delay);
+	fprintf(stderr, "\n");
+	return 1;
+}
@@ -21,14 +21,282 @@
 char *addr = "239.48.48.1";
 unsigned long int port = 1350;
 char *device = "default";
+unsigned long int sample_format = SAMPLE_FORMAT_S16;
+// whether Opus gets float samples, which follows from sample_format
 unsigned long int use_float = 0;
 unsigned long int rate = 48000;
 unsigned long int channels = 2;
-unsigned long int audio_packet_duration = 20;
+unsigned long int audio_packet_duration = 20000;
 unsigned long int buffermult = 3;
+unsigned long int use_mmap = 1;
 unsigned long int enable_time_sync = 1;
 unsigned long int verbose = 0;
 
+// frames are aligned to clock_period within each second, so there might be a shorter one at the end of it
+int64_t frame_number(int64_t tv_sec, uint32_t tv_nsec, uint64_t clock_period) {
+	int64_t frames_per_sec = (1000000000 + clock_period - 1) / clock_period;
+	return tv_sec * frames_per_sec + tv_nsec / clock_period;
+}
+
+void frame_timestamp(int64_t frame, uint64_t clock_period, struct timespec *ts) {
+	int64_t frames_per_sec = (1000000000 + clock_period - 1) / clock_period;
+	ts->tv_sec = frame / frames_per_sec;
+	ts->tv_nsec = (frame % frames_per_sec) * clock_period;
+}
+
+void spsc_init(struct spsc_queue *q, unsigned int size) {
+	unsigned int size2 = 1;
+	while (size2 < size) {
+		size2 <<= 1;
+	}
+	q->items = calloc(size2, sizeof(void *));
+	if (!q->items) {
+		fprintf(stderr, "Could not allocate %lu bytes of memory!\n", (unsigned long int) (size2 * sizeof(void *)));
+		exit(1);
+	}
+	q->mask = size2 - 1;
+	atomic_init(&q->head, 0);
+	atomic_init(&q->tail, 0);
+}
+
+int spsc_push(struct spsc_queue *q, void *item) {
+	unsigned int tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	if (tail - atomic_load_explicit(&q->head, memory_order_acquire) > q->mask) {
+		return -1;
+	}
+	q->items[tail & q->mask] = item;
+	atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+	return 0;
+}
+
+void *spsc_pop(struct spsc_queue *q) {
+	unsigned int head = atomic_load_explicit(&q->head, memory_order_relaxed);
+	if (head == atomic_load_explicit(&q->tail, memory_order_acquire)) {
+		return NULL;
+	}
+	void *item = q->items[head & q->mask];
+	atomic_store_explicit(&q->head, head + 1, memory_order_release);
+	return item;
+}
+
+void seqlock_write_begin(struct seqlock *sl) {
+	atomic_store_explicit(&sl->seq, atomic_load_explicit(&sl->seq, memory_order_relaxed) + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+}
+
+void seqlock_write_end(struct seqlock *sl) {
+	atomic_store_explicit(&sl->seq, atomic_load_explicit(&sl->seq, memory_order_relaxed) + 1, memory_order_release);
+}
+
+unsigned int seqlock_read_begin(struct seqlock *sl) {
+	return atomic_load_explicit(&sl->seq, memory_order_acquire);
+}
+
+// readers must not spin on this, as the writer might have been preempted by them
+int seqlock_read_retry(struct seqlock *sl, unsigned int seq) {
+	atomic_thread_fence(memory_order_acquire);
+	return (seq & 1) || atomic_load_explicit(&sl->seq, memory_order_relaxed) != seq;
+}
+
+int64_t time_offset_at(struct time_offset *offset, int64_t local) {
+	int64_t slewed = local < offset->slew_end ? local : offset->slew_end;
+	return offset->offset + (int64_t) (offset->freq * (local - offset->ref) + offset->slew * (slewed - offset->ref));
+}
+
+// the sample with the lowest round trip time of the window is the least affected by queueing, so it's the only one used;
+// after the first one, or after big errors, the published offset is stepped, otherwise it's slewed by a PI controller
+// acting on its rate of change, which also tracks the frequency difference of the two clocks; the slew stops once it
+// has made up for the error, as the best sample can stay the same for the whole window
+void time_sync_update(struct time_sync *ts, int64_t sent, int64_t serv, int64_t recv) {
+	unsigned int n = ts->count++ % TIME_SYNC_WINDOW;
+	ts->samples[n].local = sent + (recv - sent) / 2;
+	ts->samples[n].offset = serv - ts->samples[n].local;
+	ts->samples[n].rtt = recv - sent;
+
+	unsigned int best = n;
+	for (unsigned int i = 0; i < TIME_SYNC_WINDOW && i < ts->count; i++) {
+		if (ts->samples[i].rtt < ts->samples[best].rtt) {
+			best = i;
+		}
+	}
+	int64_t local = ts->samples[best].local;
+	if (local == ts->last_local) {
+		return;
+	}
+
+	struct time_offset offset = ts->published;
+	int64_t error = ts->samples[best].offset - time_offset_at(&offset, local);
+	if (ts->last_local == 0 || error > 10000000 || error < -10000000) {
+		offset.offset = ts->samples[best].offset;
+		offset.freq = ts->freq = 0;
+		offset.slew = 0;
+	} else {
+		ts->freq += (double) error / (local - ts->last_local) / 8;
+		ts->freq = ts->freq > 0.0005 ? 0.0005 : ts->freq < -0.0005 ? -0.0005 : ts->freq;
+		double slew = error / 4e9;
+		offset.offset = time_offset_at(&offset, local);
+		offset.freq = ts->freq;
+		offset.slew = slew > 0.0005 ? 0.0005 : slew < -0.0005 ? -0.0005 : slew;
+	}
+	offset.ref = local;
+	offset.slew_end = offset.slew != 0 ? local + (int64_t) (error / offset.slew) : local;
+	ts->last_local = local;
+
+	seqlock_write_begin(&ts->lock);
+	ts->published = offset;
+	seqlock_write_end(&ts->lock);
+}
+
+// if the writer is updating it right now, the previous value is kept
+void time_sync_read(struct time_sync *ts, struct time_offset *offset) {
+	unsigned int seq = seqlock_read_begin(&ts->lock);
+	struct time_offset offset2 = ts->published;
+	if (!seqlock_read_retry(&ts->lock, seq)) {
+		*offset = offset2;
+	}
+}
+
+void histogram_add(struct histogram *h, int64_t nsecs) {
+	// negative times, like the transit time of the later frames of a packet or of clock offset steps, can't be shifted down
+	if (nsecs < 0) {
+		nsecs = 0;
+	}
+	unsigned int b = 0;
+	for (int64_t usecs = nsecs / 1000; usecs && b < HISTOGRAM_BUCKETS - 1; usecs >>= 1) {
+		b++;
+	}
+	stat_inc(h->buckets[b]);
+}
+
+void histogram_print(FILE *f, const char *prefix, const char *name, struct histogram *h) {
+	fprintf(f, "%s%s", prefix, name);
+	for (unsigned int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+		fprintf(f, " %lu", atomic_load_explicit(&h->buckets[b], memory_order_relaxed));
+	}
+	fprintf(f, "\n");
+}
+
+struct stats_thread_args {
+	char *path;
+	void (*dump)(FILE *f);
+};
+
+// the stats file is rewritten every second, atomically so that readers never see a partial one
+static void *stats_thread(void *arg) {
+	struct stats_thread_args *args = arg;
+	size_t len = strlen(args->path) + 5;
+	char *tmppath = malloc(len);
+	if (!tmppath) {
+		fprintf(stderr, "Could not allocate %lu bytes of memory!\n", (unsigned long int) len);
+		exit(1);
+	}
+	snprintf(tmppath, len, "%s.tmp", args->path);
+
+	while (1) {
+		sleep(1);
+		FILE *f = fopen(tmppath, "w");
+		if (!f) {
+			perror(tmppath);
+			continue;
+		}
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		fprintf(f, "# time %ld.%09ld\n", now.tv_sec, now.tv_nsec);
+		fprintf(f, "# histograms are counts of power of two buckets of microseconds: <1 <2 <4 <8 ...\n");
+		args->dump(f);
+		if (fclose(f) || rename(tmppath, args->path)) {
+			perror(args->path);
+		}
+	}
+
+	pthread_exit(NULL);
+	return NULL;
+}
+
+// runs with normal priority, so that it never gets in the way of the realtime threads
+void start_stats_thread(char *path, void (*dump)(FILE *f)) {
+	static struct stats_thread_args args;
+	args.path = path;
+	args.dump = dump;
+
+	int ret;
+	pthread_t ths1;
+	pthread_attr_t thattr1;
+	struct sched_param sp;
+	sp.sched_priority = 0;
+	pthread_attr_init(&thattr1);
+	pthread_attr_setdetachstate(&thattr1, PTHREAD_CREATE_DETACHED);
+	pthread_attr_setinheritsched(&thattr1, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&thattr1, SCHED_OTHER);
+	pthread_attr_setschedparam(&thattr1, &sp);
+	if ((ret = pthread_create(&ths1, &thattr1, stats_thread, &args)) != 0) {
+		fprintf(stderr, "Error while calling pthread_create() for stats thread: error %d (%s)\n", ret, strerror(ret));
+		exit(1);
+	}
+	pthread_attr_destroy(&thattr1);
+}
+
+int64_t monotonic_now() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void (*trace_dump)(FILE *f) = NULL;
+
+static void trace_print() {
+	fprintf(stderr, "# time spent in each stage, power of two buckets of microseconds: <1 <2 <4 <8 ...\n");
+	trace_dump(stderr);
+}
+
+static void *trace_thread(void *arg) {
+	sigset_t *set = arg;
+	while (1) {
+		int sig;
+		if (sigwait(set, &sig) != 0) {
+			continue;
+		}
+		trace_print();
+		// the other signals still kill the process as they would have, without running the atexit handlers while the
+		// other threads are going on, so that the exit status tells an interrupted run apart
+		if (sig != SIGUSR1) {
+			sigset_t one;
+			sigemptyset(&one);
+			sigaddset(&one, sig);
+			signal(sig, SIG_DFL);
+			pthread_sigmask(SIG_UNBLOCK, &one, NULL);
+			raise(sig);
+		}
+	}
+
+	pthread_exit(NULL);
+	return NULL;
+}
+
+// the latency traces are printed to stderr on SIGUSR1, SIGINT and SIGTERM by a thread waiting for them, and at a normal
+// exit; this must be called before starting any other thread, so that they all inherit the blocked signals
+void start_trace_thread(void (*dump)(FILE *f)) {
+	static sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+	trace_dump = dump;
+	atexit(trace_print);
+
+	int ret;
+	pthread_t ths1;
+	pthread_attr_t thattr1;
+	pthread_attr_init(&thattr1);
+	pthread_attr_setdetachstate(&thattr1, PTHREAD_CREATE_DETACHED);
+	if ((ret = pthread_create(&ths1, &thattr1, trace_thread, &set)) != 0) {
+		fprintf(stderr, "Error while calling pthread_create() for trace thread: error %d (%s)\n", ret, strerror(ret));
+		exit(1);
+	}
+	pthread_attr_destroy(&thattr1);
+}
+
 void set_realtime_prio() {
 	struct sched_param sp;
 	if (sched_getparam(0, &sp)) {
@@ -64,7 +332,8 @@ void drop_privs_if_needed() {
 	fprintf(stderr, "Successfully dropped root privileges\n");
 }
 
-int init_socket(int is_mrx) {
+// group is the address and port to receive from, or NULL for a socket that only sends
+int init_socket(struct sockaddr_in *group) {
 	int sock = socket(AF_INET, SOCK_DGRAM, 0);
 	if (sock < 0) {
 		perror("socket");
@@ -73,8 +342,8 @@ int init_socket(int is_mrx) {
 
 	int is_mrx_multicast = 0;
 	struct ip_mreq mreq;
-	if (is_mrx) {
-		mreq.imr_multiaddr.s_addr = inet_addr(addr);
+	if (group) {
+		mreq.imr_multiaddr = group->sin_addr;
 		is_mrx_multicast = (ntohl(mreq.imr_multiaddr.s_addr) & 0xf0000000) == 0xe0000000;
 		if (is_mrx_multicast) {
 			unsigned int one = 1;
@@ -82,6 +351,15 @@ int init_socket(int is_mrx) {
 				perror("setsockopt(SO_REUSEADDR)");
 				exit(1);
 			}
+			// several groups may share the same port, each socket must only get its own one
+			unsigned int zero = 0;
+			if (setsockopt(sock, IPPROTO_IP, IP_MULTICAST_ALL, &zero, sizeof(zero)) < 0) {
+				perror("setsockopt(IP_MULTICAST_ALL)");
+			}
+		}
+		unsigned int one = 1;
+		if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one)) < 0) {
+			perror("setsockopt(SO_TIMESTAMPNS)");
 		}
 	}
 
@@ -95,7 +373,7 @@ int init_socket(int is_mrx) {
 	memset(&addrin, 0, sizeof(addrin));
 	addrin.sin_family = AF_INET;
 	addrin.sin_addr.s_addr = htonl(INADDR_ANY);
-	addrin.sin_port = htons(is_mrx ? (uint16_t)port : 0);
+	addrin.sin_port = group ? group->sin_port : 0;
 	if (bind(sock, (struct sockaddr *) &addrin, sizeof(addrin)) < 0) {
 		perror("bind");
 		exit(1);
@@ -112,7 +390,59 @@ int init_socket(int is_mrx) {
 	return sock;
 }
 
-snd_pcm_t *snd_my_init(char *device, int direction, unsigned long int rate, unsigned long int channels, unsigned long int use_float, snd_pcm_uframes_t *buffer, unsigned long int buffermult) {
+// list is a comma or whitespace separated list of <addr>[:<port>]
+void parse_destinations(char *list, struct sockaddr_in **dests, unsigned int *count) {
+	char *saveptr = NULL;
+	char *list2 = strdup(list);
+	if (!list2) {
+		fprintf(stderr, "Could not allocate %lu bytes of memory!\n", (unsigned long int) strlen(list) + 1);
+		exit(1);
+	}
+	for (char *tok = strtok_r(list2, ", \t\r\n", &saveptr); tok; tok = strtok_r(NULL, ", \t\r\n", &saveptr)) {
+		unsigned long int port2 = port;
+		char *colon = strchr(tok, ':');
+		if (colon) {
+			*colon = 0;
+			port2 = strtoul(colon + 1, NULL, 10);
+		}
+		struct sockaddr_in addrin;
+		memset(&addrin, 0, sizeof(addrin));
+		addrin.sin_family = AF_INET;
+		addrin.sin_port = htons((uint16_t) port2);
+		if (!inet_aton(tok, &addrin.sin_addr) || port2 < 1 || port2 > 65535) {
+			fprintf(stderr, "Invalid destination address '%s'\n", tok);
+			exit(1);
+		}
+		struct sockaddr_in *dests2 = realloc(*dests, (*count + 1) * sizeof(struct sockaddr_in));
+		if (!dests2) {
+			fprintf(stderr, "Could not allocate %lu bytes of memory!\n", (unsigned long int) (*count + 1) * sizeof(struct sockaddr_in));
+			exit(1);
+		}
+		*dests = dests2;
+		(*dests)[(*count)++] = addrin;
+	}
+	free(list2);
+}
+
+// one or more destinations per line, everything after a '#' is ignored
+void parse_destinations_file(char *path, struct sockaddr_in **dests, unsigned int *count) {
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		exit(1);
+	}
+	char line[1024];
+	while (fgets(line, sizeof(line), f)) {
+		char *comment = strchr(line, '#');
+		if (comment) {
+			*comment = 0;
+		}
+		parse_destinations(line, dests, count);
+	}
+	fclose(f);
+}
+
+snd_pcm_t *snd_my_init(char *device, int direction, unsigned long int rate, unsigned long int channels, unsigned long int format, snd_pcm_uframes_t *buffer, unsigned long int buffermult) {
 	snd_pcm_t *snd = NULL;
 	int dir = 0;
 	snd_pcm_hw_params_t *hw;
@@ -122,8 +452,16 @@ snd_pcm_t *snd_my_init(char *device, int direction, unsigned long int rate, unsi
 	snd_callcheck(snd_pcm_open, &snd, device, direction, direction == SND_PCM_STREAM_PLAYBACK ? SND_PCM_NONBLOCK : 0);
 	snd_callcheck(snd_pcm_hw_params_any, snd, hw);
 	snd_callcheck(snd_pcm_hw_params_set_rate_resample, snd, hw, 0);
-	snd_callcheck(snd_pcm_hw_params_set_access, snd, hw, SND_PCM_ACCESS_RW_INTERLEAVED);
-	snd_callcheck(snd_pcm_hw_params_set_format, snd, hw, use_float ? SND_PCM_FORMAT_FLOAT : SND_PCM_FORMAT_S16);
+	// with mmap access the audio can be encoded from and decoded into the ring buffer of the device, without copying it,
+	// but not every plugin supports it
+	if (use_mmap && snd_pcm_hw_params_set_access(snd, hw, SND_PCM_ACCESS_MMAP_INTERLEAVED) < 0) {
+		printverbose("mmap access not supported by %s, falling back to read/write\n", device);
+		use_mmap = 0;
+	}
+	if (!use_mmap) {
+		snd_callcheck(snd_pcm_hw_params_set_access, snd, hw, SND_PCM_ACCESS_RW_INTERLEAVED);
+	}
+	snd_callcheck(snd_pcm_hw_params_set_format, snd, hw, pcm_alsa_format(format));
 	snd_callcheck(snd_pcm_hw_params_set_rate, snd, hw, rate, 0);
 	snd_callcheck(snd_pcm_hw_params_set_channels, snd, hw, channels);
 	snd_pcm_uframes_t samples = *buffer;
@@ -137,3 +475,41 @@ snd_pcm_t *snd_my_init(char *device, int direction, unsigned long int rate, unsi
 	snd_callcheck(snd_pcm_sw_params, snd, sw);
 	return snd;
 }
+
+// returns where the next frames are in the ring buffer of the device, to be read or written in place and then given back
+// with snd_pcm_mmap_commit, or NULL if fewer than frames are available or if they wrap around the end of the ring, in which
+// case snd_my_readi or snd_my_writei must be used instead; when capturing it waits for them to be captured like snd_pcm_readi,
+// when playing it never waits; *ret is negative on errors, to be recovered from as usual
+void *snd_my_mmap_begin(snd_pcm_t *snd, snd_pcm_uframes_t frames, snd_pcm_uframes_t *offset, snd_pcm_sframes_t *ret) {
+	while ((*ret = snd_pcm_avail_update(snd)) >= 0 && *ret < (snd_pcm_sframes_t) frames && snd_pcm_stream(snd) == SND_PCM_STREAM_CAPTURE) {
+		// unlike with snd_pcm_readi, the capture does not start by itself
+		if (snd_pcm_state(snd) == SND_PCM_STATE_PREPARED && (*ret = snd_pcm_start(snd)) < 0) {
+			return NULL;
+		}
+		if ((*ret = snd_pcm_wait(snd, 1000)) < 0) {
+			return NULL;
+		}
+	}
+	if (*ret < (snd_pcm_sframes_t) frames) {
+		return NULL;
+	}
+
+	const snd_pcm_channel_area_t *areas;
+	snd_pcm_uframes_t contiguous = frames;
+	if ((*ret = snd_pcm_mmap_begin(snd, &areas, offset, &contiguous)) < 0) {
+		return NULL;
+	}
+	if (contiguous < frames) {
+		*ret = snd_pcm_mmap_commit(snd, *offset, 0);
+		return NULL;
+	}
+	return (uint8_t *) areas[0].addr + (areas[0].first + *offset * areas[0].step) / 8;
+}
+
+snd_pcm_sframes_t snd_my_readi(snd_pcm_t *snd, void *buffer, snd_pcm_uframes_t frames) {
+	return use_mmap ? snd_pcm_mmap_readi(snd, buffer, frames) : snd_pcm_readi(snd, buffer, frames);
+}
+
+snd_pcm_sframes_t snd_my_writei(snd_pcm_t *snd, const void *buffer, snd_pcm_uframes_t frames) {
+	return use_mmap ? snd_pcm_mmap_writei(snd, buffer, frames) : snd_pcm_writei(snd, buffer, frames);
+}
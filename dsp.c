@@ -0,0 +1,289 @@
+/*
+ * mtrx - Transmit and receive audio via UDP unicast or multicast
+ * Copyright (C) 2014-2017 Vittorio Gambaletta <openwrt@vittgam.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mtrx.h"
+
+// the output stage of mrx: a channel matrix, for remapping or downmixing the decoded channels, followed by a gain
+// which moves to a new value over a whole frame instead of jumping, so that volume changes don't click; S16 frames
+// go through float and back with saturation, so that the same kernels serve both; like the ones of pcm.c, the SIMD
+// kernels do the bulk of each frame, leave the rest to the plain C ones and give the same results
+
+static void s16_to_float(float *out, const int16_t *in, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		out[i] = in[i];
+	}
+}
+
+static void float_to_s16(int16_t *out, const float *in, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		out[i] = lrintf(in[i] > 32767.0f ? 32767.0f : in[i] < -32768.0f ? -32768.0f : in[i]);
+	}
+}
+
+static void matrix(float *out, const float *in, size_t frames, unsigned int in_channels, unsigned int out_channels, const float *m) {
+	for (size_t i = 0; i < frames; i++, in += in_channels) {
+		for (unsigned int o = 0; o < out_channels; o++) {
+			float sum = m[o * in_channels] * in[0];
+			for (unsigned int c = 1; c < in_channels; c++) {
+				sum += m[o * in_channels + c] * in[c];
+			}
+			*out++ = sum;
+		}
+	}
+}
+
+// the gain goes from gain to gain + step * n along the samples
+static void gain_ramp(float *pcm, size_t n, size_t i, float gain, float step) {
+	for (; i < n; i++) {
+		pcm[i] *= gain + step * i;
+	}
+}
+
+#if defined(__SSE2__)
+
+// SSE2 is always there on x86-64, and nothing here needs more than that
+
+static size_t s16_to_float_simd(float *out, const int16_t *in, size_t n) {
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (in + i));
+		_mm_storeu_ps(out + i, _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16)));
+		_mm_storeu_ps(out + i + 4, _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16)));
+	}
+	return i;
+}
+
+static size_t float_to_s16_simd(int16_t *out, const float *in, size_t n) {
+	size_t i = 0;
+	__m128 min = _mm_set1_ps(-32768.0f), max = _mm_set1_ps(32767.0f);
+	for (; i + 8 <= n; i += 8) {
+		__m128i a = _mm_cvtps_epi32(_mm_max_ps(_mm_min_ps(_mm_loadu_ps(in + i), max), min));
+		__m128i b = _mm_cvtps_epi32(_mm_max_ps(_mm_min_ps(_mm_loadu_ps(in + i + 4), max), min));
+		_mm_storeu_si128((__m128i *) (out + i), _mm_packs_epi32(a, b));
+	}
+	return i;
+}
+
+// only for stereo input to mono or stereo output, which covers downmixing, picking and swapping channels
+static size_t matrix_simd(float *out, const float *in, size_t frames, unsigned int in_channels, unsigned int out_channels, const float *m) {
+	size_t i = 0;
+	if (in_channels != 2 || out_channels > 2) {
+		return 0;
+	}
+	__m128 m00 = _mm_set1_ps(m[0]), m01 = _mm_set1_ps(m[1]);
+	__m128 m10 = _mm_set1_ps(m[out_channels > 1 ? 2 : 0]), m11 = _mm_set1_ps(m[out_channels > 1 ? 3 : 1]);
+	for (; i + 4 <= frames; i += 4) {
+		__m128 a = _mm_loadu_ps(in + i * 2), b = _mm_loadu_ps(in + i * 2 + 4);
+		__m128 left = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)), right = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+		__m128 o0 = _mm_add_ps(_mm_mul_ps(m00, left), _mm_mul_ps(m01, right));
+		if (out_channels == 1) {
+			_mm_storeu_ps(out + i, o0);
+		} else {
+			__m128 o1 = _mm_add_ps(_mm_mul_ps(m10, left), _mm_mul_ps(m11, right));
+			_mm_storeu_ps(out + i * 2, _mm_unpacklo_ps(o0, o1));
+			_mm_storeu_ps(out + i * 2 + 4, _mm_unpackhi_ps(o0, o1));
+		}
+	}
+	return i;
+}
+
+static size_t gain_ramp_simd(float *pcm, size_t n, float gain, float step) {
+	size_t i = 0;
+	__m128 g = _mm_set1_ps(gain), s = _mm_set1_ps(step);
+	__m128i index = _mm_setr_epi32(0, 1, 2, 3), four = _mm_set1_epi32(4);
+	for (; i + 4 <= n; i += 4) {
+		__m128 x = _mm_mul_ps(_mm_loadu_ps(pcm + i), _mm_add_ps(g, _mm_mul_ps(s, _mm_cvtepi32_ps(index))));
+		_mm_storeu_ps(pcm + i, x);
+		index = _mm_add_epi32(index, four);
+	}
+	return i;
+}
+
+#elif defined(__ARM_NEON)
+
+static size_t s16_to_float_simd(float *out, const int16_t *in, size_t n) {
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		int16x8_t v = vld1q_s16(in + i);
+		vst1q_f32(out + i, vcvtq_f32_s32(vmovl_s16(vget_low_s16(v))));
+		vst1q_f32(out + i + 4, vcvtq_f32_s32(vmovl_s16(vget_high_s16(v))));
+	}
+	return i;
+}
+
+// rounding toward zero on 32 bit ARM, which has no rounding conversion
+static int32x4_t float_to_s32_round(float32x4_t x) {
+#ifdef __aarch64__
+	return vcvtnq_s32_f32(x);
+#else
+	return vcvtq_s32_f32(x);
+#endif
+}
+
+static size_t float_to_s16_simd(int16_t *out, const float *in, size_t n) {
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		int16x4_t a = vqmovn_s32(float_to_s32_round(vld1q_f32(in + i)));
+		int16x4_t b = vqmovn_s32(float_to_s32_round(vld1q_f32(in + i + 4)));
+		vst1q_s16(out + i, vcombine_s16(a, b));
+	}
+	return i;
+}
+
+static size_t matrix_simd(float *out, const float *in, size_t frames, unsigned int in_channels, unsigned int out_channels, const float *m) {
+	size_t i = 0;
+	if (in_channels != 2 || out_channels > 2) {
+		return 0;
+	}
+	for (; i + 4 <= frames; i += 4) {
+		float32x4x2_t v = vld2q_f32(in + i * 2);
+		float32x4_t o0 = vaddq_f32(vmulq_n_f32(v.val[0], m[0]), vmulq_n_f32(v.val[1], m[1]));
+		if (out_channels == 1) {
+			vst1q_f32(out + i, o0);
+		} else {
+			float32x4x2_t o = {{o0, vaddq_f32(vmulq_n_f32(v.val[0], m[2]), vmulq_n_f32(v.val[1], m[3]))}};
+			vst2q_f32(out + i * 2, o);
+		}
+	}
+	return i;
+}
+
+static size_t gain_ramp_simd(float *pcm, size_t n, float gain, float step) {
+	size_t i = 0;
+	const uint32_t first[4] = {0, 1, 2, 3};
+	uint32x4_t index = vld1q_u32(first);
+	for (; i + 4 <= n; i += 4) {
+		float32x4_t g = vaddq_f32(vdupq_n_f32(gain), vmulq_n_f32(vcvtq_f32_u32(index), step));
+		vst1q_f32(pcm + i, vmulq_f32(vld1q_f32(pcm + i), g));
+		index = vaddq_u32(index, vdupq_n_u32(4));
+	}
+	return i;
+}
+
+#else
+
+static size_t s16_to_float_simd(float *out, const int16_t *in, size_t n) {
+	return 0;
+}
+
+static size_t float_to_s16_simd(int16_t *out, const float *in, size_t n) {
+	return 0;
+}
+
+static size_t matrix_simd(float *out, const float *in, size_t frames, unsigned int in_channels, unsigned int out_channels, const float *m) {
+	return 0;
+}
+
+static size_t gain_ramp_simd(float *pcm, size_t n, float gain, float step) {
+	return 0;
+}
+
+#endif
+
+// the matrix has a row of coefficients for each output channel, separated by ';', with one coefficient for each
+// decoded channel, separated by ','; "mono" averages all of them; NULL passes them through as they are
+void dsp_init(struct dsp *d, char *spec, unsigned int in_channels, size_t max_frames, float gain) {
+	memset(d, 0, sizeof(*d));
+	d->in_channels = in_channels;
+	d->out_channels = in_channels;
+	d->gain = gain;
+
+	if (spec && strcmp(spec, "mono") == 0) {
+		d->out_channels = 1;
+		d->matrix = malloc(in_channels * sizeof(float));
+		if (!d->matrix) {
+			fprintf(stderr, "Could not allocate %lu bytes of memory!\n", (unsigned long int) in_channels * sizeof(float));
+			exit(1);
+		}
+		for (unsigned int c = 0; c < in_channels; c++) {
+			d->matrix[c] = 1.0f / in_channels;
+		}
+	} else if (spec) {
+		d->out_channels = 1;
+		for (char *p = spec; *p; p++) {
+			d->out_channels += *p == ';';
+		}
+		d->matrix = malloc(d->out_channels * in_channels * sizeof(float));
+		if (!d->matrix) {
+			fprintf(stderr, "Could not allocate %lu bytes of memory!\n", (unsigned long int) d->out_channels * in_channels * sizeof(float));
+			exit(1);
+		}
+		char *p = spec;
+		for (unsigned int o = 0; o < d->out_channels; o++) {
+			for (unsigned int c = 0; c < in_channels; c++) {
+				char *end;
+				d->matrix[o * in_channels + c] = strtod(p, &end);
+				if (end == p || *end != (c == in_channels - 1 ? (o == d->out_channels - 1 ? 0 : ';') : ',')) {
+					fprintf(stderr, "Invalid channel matrix, it needs %u comma separated coefficients for each output channel, separated by ';'\n", in_channels);
+					exit(1);
+				}
+				p = end + !!*end;
+			}
+		}
+	}
+
+	size_t size = max_frames * (in_channels > d->out_channels ? in_channels : d->out_channels) * sizeof(float);
+	d->tmp = malloc(size);
+	d->tmp2 = malloc(size);
+	if (!d->tmp || !d->tmp2) {
+		fprintf(stderr, "Could not allocate %lu bytes of memory!\n", (unsigned long int) size * 2);
+		exit(1);
+	}
+}
+
+void dsp_destroy(struct dsp *d) {
+	free(d->matrix);
+	free(d->tmp);
+	free(d->tmp2);
+}
+
+// processes frames (at most max_frames) of S16 or float samples from in to out, which must not overlap,
+// moving the gain from the one of the previous call to the given one
+void dsp_process(struct dsp *d, void *out, const void *in, size_t frames, float gain, int s16) {
+	size_t n_in = frames * d->in_channels, n_out = frames * d->out_channels;
+	const float *src = in;
+	size_t i = 0;
+	if (s16) {
+		if (pcm_simd) {
+			i = s16_to_float_simd(d->tmp, in, n_in);
+		}
+		s16_to_float(d->tmp + i, (const int16_t *) in + i, n_in - i);
+		src = d->tmp;
+	}
+
+	// S16 samples stay in the scratch buffers until the end, float ones go to out right away
+	float *dst = s16 ? (d->matrix ? d->tmp2 : d->tmp) : out;
+	if (d->matrix) {
+		i = pcm_simd ? matrix_simd(dst, src, frames, d->in_channels, d->out_channels, d->matrix) : 0;
+		matrix(dst + i * d->out_channels, src + i * d->in_channels, frames - i, d->in_channels, d->out_channels, d->matrix);
+	} else if (dst != src) {
+		memcpy(dst, src, n_out * sizeof(float));
+	}
+
+	if (gain != 1 || d->gain != 1) {
+		float step = (gain - d->gain) / n_out;
+		i = pcm_simd ? gain_ramp_simd(dst, n_out, d->gain, step) : 0;
+		gain_ramp(dst, n_out, i, d->gain, step);
+		d->gain = gain;
+	}
+
+	if (s16) {
+		i = pcm_simd ? float_to_s16_simd(out, dst, n_out) : 0;
+		float_to_s16((int16_t *) out + i, dst + i, n_out - i);
+	}
+}
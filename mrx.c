@@ -19,67 +19,654 @@
 #include "mtrx.h"
 
 static signed long int delay = 80;
-static struct azz *audio_buffer = NULL;
+static signed long int min_delay = 0;
+static unsigned long int drift_comp = 0;
+static char *stats_file = NULL;
+static unsigned long int recv_batch = 16;
+static unsigned long int sim_loss = 0;
+static unsigned long int sim_loss_burst = 1;
+static unsigned long int sim_jitter = 0, sim_reorder = 0, sim_dup = 0;
+static char *record_path = NULL;
+static FILE *record_file = NULL;
+static char *replay_source = NULL;
+static unsigned int audio_buffer_size = 0;
+static char *gains = NULL;
+static char *stream_ids = NULL;
+static unsigned long int decode_workers = 0;
+static char *matrix_spec = NULL;
+static char *volume_file = NULL;
+// the output volume in hundredths of dB, which the output stage follows smoothly
+static _Atomic long int volume_cdb = 0;
+static struct dsp dsp;
+static int use_dsp = 0;
 static pthread_barrier_t init_barrier;
-static pthread_mutex_t audio_mutex, time_mutex;
-static struct timespec last_packet_clock = {0, 0};
-static int64_t server_time_diff_global = 0;
 
-static void *audio_playback_thread(void *arg) {
-	printverbose("Audio playback thread started\n");
+// counters of the whole process, written by the playback thread
+static struct {
+	_Atomic long int alsa_resets, alsa_recoveries, alsa_zero_writes, alsa_short_writes, drift_ppm;
+	// from the decoded frames being ready to their write returning, and how much was queued in the sound card then
+	struct histogram output_time, alsa_delay;
+} stats;
 
-	snd_pcm_uframes_t samples = audio_packet_duration * rate / 1000;
-	size_t pcm_size_multiplier = (use_float ? sizeof(float) : sizeof(int16_t)) * channels;
-	size_t pcm_size = samples * pcm_size_multiplier;
-	uint64_t clock_period = (uint64_t) 1000000 * audio_packet_duration;
+// counters of each stream, written by the receive thread or by the thread decoding it
+struct stream_stats {
+	// receive thread
+	_Atomic long int received, too_big, invalid, dropped, simulated_loss, bundled, other_stream, seq_gaps, seq_reordered, time_rtt_us, time_offset_us, time_freq_ppb;
+	// decoding thread
+	_Atomic long int played, late, duplicated, future, parity_received, parity_recovered, fec_recovered, concealed, adaptive_inserted, adaptive_skipped, delay_ms;
+	// the stages of the frames: from the transmitter timestamp and from the kernel one to the receive thread queueing them,
+	// in the queue until the decoding thread takes them, in the jitter buffer, and being decoded
+	struct histogram transit_time, receive_time, recv_queue, jitter_buffer, decode_time;
+};
+
+// the jitter buffer playout, driven by the real clock in the playback thread or by a virtual one when replaying
+struct playout {
+	OpusDecoder *decoder;
+	snd_pcm_uframes_t samples;
+	uint64_t clock_period;
+	int64_t delay2, alsa_delay;
+	void *pcm, *pcm2;
+	// in adaptive mode frames are played up to advance_max frames earlier than what -e says,
+	// moving by one frame at a time by concealing one more frame or by skipping one
+	int64_t advance, advance_max;
+	// the highest transit time from the transmitter (or how late a frame was received after its timestamp) is tracked
+	// over two sliding windows, and the delay is kept above it plus some margin for the scheduling latency
+	int64_t transit_max[2];
+	int64_t adaptive_window, adaptive_margin;
+	int64_t ticks, last_advance_tick;
+};
+
+// everything about one of the received streams: the receive thread owns the socket side, and the thread decoding it
+// (always the same one) owns the buffers, the slots going back and forth between them through the queues
+struct stream {
+	struct sockaddr_in addr;
+	int sock;
+	float gain;
+	// the stream id taken from packets with the compact header, and the sequence number expected next
+	uint8_t id;
+	uint16_t seq_next;
+	int seq_started;
+	// takes apart the packets of several frames sent by mtx -N, in the receive thread
+	OpusRepacketizer *repacketizer;
+	struct azz **recv_frames;
+	struct azz *drop_frame;
+	// time requests go out of a socket of their own, so that the replies come back to this stream even when the
+	// sockets of several streams share the same port, which the kernel would give them to only one of
+	int time_sock;
+	struct timespec last_time_sent;
+	// the counters as of the previous report sent along with the time requests
+	struct reportp last_report;
+	int reporting;
+	struct time_sync time_sync;
+	struct spsc_queue recv_queue, free_queue;
+	struct azz **audio_buffer;
+	struct azz **parity_buffer;
+	int64_t audio_buffer_head;
+	unsigned int parity_count, parity_depth;
+	struct azz *play_frame;
+	struct playout playout;
+	int64_t server_time_diff;
+	struct timespec last_packet_clock;
+	struct stream_stats stats;
+};
+
+static struct stream *streams = NULL;
+static unsigned int stream_count = 0;
+
+static void trace_dump(FILE *f) {
+	for (unsigned int i = 0; i < stream_count; i++) {
+		struct stream_stats *st = &streams[i].stats;
+		char prefix[32] = "";
+		if (stream_count > 1) {
+			snprintf(prefix, sizeof(prefix), "stream%u.", i);
+		}
+		histogram_print(f, prefix, "transit_time", &st->transit_time);
+		histogram_print(f, prefix, "receive_time", &st->receive_time);
+		histogram_print(f, prefix, "recv_queue", &st->recv_queue);
+		histogram_print(f, prefix, "jitter_buffer", &st->jitter_buffer);
+		histogram_print(f, prefix, "decode_time", &st->decode_time);
+	}
+	histogram_print(f, "", "output_time", &stats.output_time);
+	histogram_print(f, "", "alsa_delay", &stats.alsa_delay);
+}
+
+static void stats_dump(FILE *f) {
+	stat_print(f, "", stats, alsa_resets);
+	stat_print(f, "", stats, alsa_recoveries);
+	stat_print(f, "", stats, alsa_zero_writes);
+	stat_print(f, "", stats, alsa_short_writes);
+	stat_print(f, "", stats, drift_ppm);
+	// with more than one stream, the counters of each one are prefixed by its index in the -h list
+	for (unsigned int i = 0; i < stream_count; i++) {
+		struct stream_stats *st = &streams[i].stats;
+		char prefix[32] = "";
+		if (stream_count > 1) {
+			snprintf(prefix, sizeof(prefix), "stream%u.", i);
+		}
+		stat_print(f, prefix, *st, received);
+		stat_print(f, prefix, *st, too_big);
+		stat_print(f, prefix, *st, invalid);
+		stat_print(f, prefix, *st, dropped);
+		stat_print(f, prefix, *st, simulated_loss);
+		stat_print(f, prefix, *st, bundled);
+		stat_print(f, prefix, *st, other_stream);
+		stat_print(f, prefix, *st, seq_gaps);
+		stat_print(f, prefix, *st, seq_reordered);
+		stat_print(f, prefix, *st, played);
+		stat_print(f, prefix, *st, late);
+		stat_print(f, prefix, *st, duplicated);
+		stat_print(f, prefix, *st, future);
+		stat_print(f, prefix, *st, parity_received);
+		stat_print(f, prefix, *st, parity_recovered);
+		stat_print(f, prefix, *st, fec_recovered);
+		stat_print(f, prefix, *st, concealed);
+		stat_print(f, prefix, *st, adaptive_inserted);
+		stat_print(f, prefix, *st, adaptive_skipped);
+		stat_print(f, prefix, *st, delay_ms);
+		stat_print(f, prefix, *st, time_rtt_us);
+		stat_print(f, prefix, *st, time_offset_us);
+		stat_print(f, prefix, *st, time_freq_ppb);
+	}
+	trace_dump(f);
+}
+
+// parity packets are indexed by block and by their index in it, frame being the first frame of the block
+static void parity_buffer_insert(struct stream *s, struct azz *currframe) {
+	struct parityp *parity = (struct parityp *) &currframe->packet.data;
+	if (currframe->datalen < offsetof(struct parityp, data) || parity->count < 2 || parity->count > 32 || parity->depth < 1 || parity->index >= parity->depth) {
+		fprintf(stderr, "Received invalid parity packet %"PRIi64".%09"PRIu32"\n", currframe->packet.tv_sec, currframe->packet.tv_nsec & ~PARITY_FLAG);
+		stat_inc(s->stats.invalid);
+		spsc_push(&s->free_queue, currframe);
+		return;
+	}
+	parity->mask = be32toh(parity->mask);
+	parity->datalen = be16toh(parity->datalen);
+	currframe->datalen -= offsetof(struct parityp, data);
+	stat_inc(s->stats.parity_received);
+	s->parity_count = parity->count;
+	s->parity_depth = parity->depth;
+
+	unsigned int block_len = parity->count * parity->depth;
+	struct azz **slot = &s->parity_buffer[(currframe->frame / block_len * parity->depth + parity->index) % audio_buffer_size];
+	if (currframe->frame + block_len > s->audio_buffer_head) {
+		struct azz *tmp = *slot;
+		*slot = currframe;
+		currframe = tmp;
+	}
+	spsc_push(&s->free_queue, currframe);
+}
+
+// rebuilds a lost frame from the parity packet of its block and the other frames it protects, which are kept in the audio buffer after being played
+static struct azz *parity_recover(struct stream *s, int64_t frame, uint64_t clock_period) {
+	if (!s->parity_count) {
+		return NULL;
+	}
+	unsigned int block_len = s->parity_count * s->parity_depth;
+	int64_t start = frame - frame % block_len;
+	unsigned int j = (frame - start) % s->parity_depth;
+	unsigned int i = (frame - start) / s->parity_depth;
+	struct azz *paritypacket = s->parity_buffer[(start / block_len * s->parity_depth + j) % audio_buffer_size];
+	struct parityp *parity = (struct parityp *) &paritypacket->packet.data;
+	if (paritypacket->frame != start || parity->count != s->parity_count || parity->depth != s->parity_depth || parity->index != j || !(parity->mask & (1U << i))) {
+		return NULL;
+	}
+
+	struct azz *currframe = s->play_frame;
+	uint32_t datalen = parity->datalen;
+	memcpy(&currframe->packet.data, &parity->data, paritypacket->datalen);
+	for (unsigned int k = 0; k < s->parity_count; k++) {
+		if (k == i || !(parity->mask & (1U << k))) {
+			continue;
+		}
+		int64_t frame2 = start + j + k * s->parity_depth;
+		struct azz *currframe2 = s->audio_buffer[frame2 % audio_buffer_size];
+		if (currframe2->frame != frame2 || currframe2->datalen > paritypacket->datalen) {
+			return NULL;
+		}
+		for (uint32_t n = 0; n < currframe2->datalen; n++) {
+			(&currframe->packet.data)[n] ^= (&currframe2->packet.data)[n];
+		}
+		datalen ^= currframe2->datalen;
+	}
+	if (datalen == 0 || datalen > paritypacket->datalen) {
+		return NULL;
+	}
+
+	struct timespec ts;
+	frame_timestamp(frame, clock_period, &ts);
+	currframe->packet.tv_sec = ts.tv_sec;
+	currframe->packet.tv_nsec = ts.tv_nsec;
+	currframe->datalen = datalen;
+	currframe->frame = frame;
+	s->play_frame = s->audio_buffer[frame % audio_buffer_size];
+	s->audio_buffer[frame % audio_buffer_size] = currframe;
+	return currframe;
+}
+
+// called by the thread decoding the stream only, which owns the audio buffer
+static void audio_buffer_insert(struct stream *s, struct azz *currframe) {
+	if (currframe->packet.tv_nsec & PARITY_FLAG) {
+		parity_buffer_insert(s, currframe);
+		return;
+	}
+	struct azz **slot = &s->audio_buffer[currframe->frame % audio_buffer_size];
+	if (currframe->frame < s->audio_buffer_head) {
+		printverbose("Received frame %"PRIi64".%09"PRIu32" in the past (current = %"PRIi64")\n", currframe->packet.tv_sec, currframe->packet.tv_nsec, s->audio_buffer_head);
+		stat_inc(s->stats.late);
+	} else if ((*slot)->frame == currframe->frame) {
+		printverbose("Received duplicated frame %"PRIi64".%09"PRIu32"\n", currframe->packet.tv_sec, currframe->packet.tv_nsec);
+		stat_inc(s->stats.duplicated);
+	} else {
+		// the slot is reused anyway, this only means that frames in between will be lost
+		if (s->audio_buffer_head && currframe->frame >= s->audio_buffer_head + audio_buffer_size) {
+			printverbose("Received frame %"PRIi64".%09"PRIu32" too far in the future (current = %"PRIi64")\n", currframe->packet.tv_sec, currframe->packet.tv_nsec, s->audio_buffer_head);
+			stat_inc(s->stats.future);
+		}
+		struct azz *tmp = *slot;
+		*slot = currframe;
+		currframe = tmp;
+	}
+	spsc_push(&s->free_queue, currframe);
+}
+
+// decodes the given frame, rebuilding it from parity or from the FEC data in the next one if it's missing, or else concealing it
+static int decode_frame(struct stream *s, OpusDecoder *decoder, int64_t frame, void *pcm, snd_pcm_uframes_t samples, uint64_t clock_period) {
+	// frames are decoded in place, and stay in the buffer until their slot is needed again
+	struct azz *currframe = s->audio_buffer[frame % audio_buffer_size];
+	if (currframe->frame == frame) {
+		printverbose("got packet %"PRIi64".%09"PRIu32"\n", currframe->packet.tv_sec, currframe->packet.tv_nsec);
+	} else if ((currframe = parity_recover(s, frame, clock_period))) {
+		printverbose("recovered packet %"PRIi64".%09"PRIu32" from parity\n", currframe->packet.tv_sec, currframe->packet.tv_nsec);
+		stat_inc(s->stats.parity_recovered);
+	}
+
+	unsigned char *data = NULL;
+	uint32_t datalen = 0;
+	if (currframe) {
+		data = &currframe->packet.data;
+		datalen = currframe->datalen;
+	} else {
+		struct azz *nextframe = s->audio_buffer[(frame + 1) % audio_buffer_size];
+		if (nextframe->frame == frame + 1) {
+			printverbose("no packet received, using FEC from the next one!\n");
+			stat_inc(s->stats.fec_recovered);
+			data = &nextframe->packet.data;
+			datalen = nextframe->datalen;
+		} else {
+			printverbose("no packet received!\n");
+			stat_inc(s->stats.concealed);
+		}
+	}
+
+	int64_t t1 = monotonic_now();
+	if (currframe && currframe->frame == frame) {
+		histogram_add(&s->stats.jitter_buffer, t1 - currframe->trace_time);
+	}
+
+	int r;
+	if (use_float) {
+		r = opus_decode_float(decoder, data, datalen, pcm, samples, !currframe);
+	} else {
+		r = opus_decode(decoder, data, datalen, pcm, samples, !currframe);
+	}
+
+	histogram_add(&s->stats.decode_time, monotonic_now() - t1);
+
+	if (r != samples) {
+		fprintf(stderr, "opus_decode: %s\n", opus_strerror(r));
+		exit(1);
+	}
+	stat_inc(s->stats.played);
+
+	return currframe != NULL;
+}
+
+// fades from pcm2 to pcm over the whole frame, used to skip a frame without clicks
+static void crossfade(void *pcm, void *pcm2, snd_pcm_uframes_t samples) {
+	for (snd_pcm_uframes_t i = 0; i < samples; i++) {
+		for (unsigned long int c = 0; c < channels; c++) {
+			if (use_float) {
+				float *out = (float *) pcm + i * channels + c;
+				*out = (*out * i + ((float *) pcm2)[i * channels + c] * (samples - i)) / samples;
+			} else {
+				int16_t *out = (int16_t *) pcm + i * channels + c;
+				*out = ((int32_t) *out * (int32_t) i + (int32_t) ((int16_t *) pcm2)[i * channels + c] * (int32_t) (samples - i)) / (int32_t) samples;
+			}
+		}
+	}
+}
+
+// linear interpolation of one frame of samples at the given step, continuing from where the previous call left,
+// the position being relative to the last sample of the previous frame, which is kept in prev
+static double resample_pos = 0;
+
+static snd_pcm_uframes_t resample(void *out, void *in, float *prev, snd_pcm_uframes_t samples, double step) {
+	snd_pcm_uframes_t n = 0;
+	double pos = resample_pos;
+	for (; pos < samples; pos += step, n++) {
+		long int i = (long int) pos;
+		float frac = pos - i;
+		for (unsigned long int c = 0; c < channels; c++) {
+			float a, b;
+			if (use_float) {
+				a = i ? ((float *) in)[(i - 1) * channels + c] : prev[c];
+				b = ((float *) in)[i * channels + c];
+				((float *) out)[n * channels + c] = a + (b - a) * frac;
+			} else {
+				a = i ? ((int16_t *) in)[(i - 1) * channels + c] : prev[c];
+				b = ((int16_t *) in)[i * channels + c];
+				((int16_t *) out)[n * channels + c] = lrintf(a + (b - a) * frac);
+			}
+		}
+	}
+	resample_pos = pos - samples;
+	for (unsigned long int c = 0; c < channels; c++) {
+		prev[c] = use_float ? ((float *) in)[(samples - 1) * channels + c] : ((int16_t *) in)[(samples - 1) * channels + c];
+	}
+	return n;
+}
+
+static void playout_init(struct playout *p, int64_t delay2, int64_t alsa_delay) {
+	memset(p, 0, sizeof(*p));
+	p->samples = (uint64_t) audio_packet_duration * rate / 1000000;
+	p->clock_period = (uint64_t) 1000 * audio_packet_duration;
+	p->delay2 = delay2;
+	p->alsa_delay = alsa_delay;
 
 	int error;
-	OpusDecoder *decoder = opus_decoder_create(rate, channels, &error);
-	if (decoder == NULL) {
+	p->decoder = opus_decoder_create(rate, channels, &error);
+	if (p->decoder == NULL) {
 		fprintf(stderr, "opus_decoder_create: %s\n", opus_strerror(error));
 		exit(1);
 	}
 
-	void *pcm = alloca(pcm_size);
+	size_t pcm_size = p->samples * (use_float ? sizeof(float) : sizeof(int16_t)) * channels;
+	p->pcm = malloc(pcm_size);
+	p->pcm2 = malloc(pcm_size);
+	if (!p->pcm || !p->pcm2) {
+		fprintf(stderr, "Could not allocate %lu bytes of memory!\n", (unsigned long int) pcm_size * 2);
+		exit(1);
+	}
+
+	if (min_delay) {
+		int64_t min_delay2 = (int64_t) min_delay * 1000000 - alsa_delay;
+		if (min_delay2 < 0 || min_delay2 > -delay2) {
+			fprintf(stderr, "Minimum audio delay minus ALSA delay (%"PRIi64") must be between 0 and the total one minus ALSA delay (%ld).\n", min_delay2 / 1000000, delay);
+			exit(1);
+		}
+		p->advance_max = (-delay2 - min_delay2) / p->clock_period;
+	}
+	p->transit_max[0] = p->transit_max[1] = INT64_MIN;
+	p->adaptive_window = 2000000000 / p->clock_period;
+	p->adaptive_margin = 2000000;
+}
+
+static void playout_destroy(struct playout *p) {
+	opus_decoder_destroy(p->decoder);
+	free(p->pcm);
+	free(p->pcm2);
+}
+
+// server_time_diff maps the receive time of the frame to the transmitter clock
+static void playout_receive(struct stream *s, struct azz *currframe, int64_t server_time_diff) {
+	struct playout *p = &s->playout;
+	if (!(currframe->packet.tv_nsec & PARITY_FLAG)) {
+		int64_t transit = currframe->recv_time + server_time_diff - (currframe->packet.tv_sec * 1000000000 + currframe->packet.tv_nsec);
+		if (transit > p->transit_max[0]) {
+			p->transit_max[0] = transit;
+		}
+		histogram_add(&s->stats.transit_time, transit);
+	}
+	audio_buffer_insert(s, currframe);
+}
+
+// decodes into p->pcm the frame to be played at now (on the transmitter clock, delay included),
+// returns 1 if it was received or recovered
+static int playout_tick(struct stream *s, struct timespec *now) {
+	struct playout *p = &s->playout;
+	int adjust = 0;
+	if (p->advance_max) {
+		if (++p->ticks % p->adaptive_window == 0) {
+			p->transit_max[1] = p->transit_max[0];
+			p->transit_max[0] = INT64_MIN;
+		}
+		int64_t transit = p->transit_max[0] > p->transit_max[1] ? p->transit_max[0] : p->transit_max[1];
+		if (transit != INT64_MIN) {
+			int64_t target = -p->delay2 - transit - p->adaptive_margin;
+			// never later than -e, which is the maximum delay
+			target = target < 0 ? 0 : target / (int64_t) p->clock_period;
+			// get later right away, but get earlier only slowly and when the whole history says it's safe
+			if (target < p->advance && p->advance > 0) {
+				adjust = -1;
+			} else if (target > p->advance && p->advance < p->advance_max && p->transit_max[1] != INT64_MIN && p->ticks - p->last_advance_tick >= p->adaptive_window / 8) {
+				adjust = 1;
+			}
+		}
+		if (adjust) {
+			p->advance += adjust;
+			p->last_advance_tick = p->ticks;
+			printverbose("adaptive delay: transit %"PRIi64" ns, now %"PRIi64" ms\n", transit, (-p->delay2 - p->advance * (int64_t) p->clock_period) / 1000000);
+			if (adjust < 0) {
+				stat_inc(s->stats.adaptive_inserted);
+			} else {
+				stat_inc(s->stats.adaptive_skipped);
+			}
+			stat_set(s->stats.delay_ms, (-p->delay2 - p->advance * (int64_t) p->clock_period + p->alsa_delay) / 1000000);
+		}
+	}
+
+	int64_t frame = frame_number(now->tv_sec, now->tv_nsec, p->clock_period) + p->advance;
+	if (adjust < 0) {
+		// the frame that should be played now was already played in the previous tick
+		printverbose("adaptive delay: inserting a concealed frame\n");
+		if (use_float) {
+			opus_decode_float(p->decoder, NULL, 0, p->pcm, p->samples, 1);
+		} else {
+			opus_decode(p->decoder, NULL, 0, p->pcm, p->samples, 1);
+		}
+		return 0;
+	}
+
+	if (adjust > 0) {
+		printverbose("adaptive delay: skipping a frame\n");
+		decode_frame(s, p->decoder, frame - 1, p->pcm2, p->samples, p->clock_period);
+	}
+	int ret = decode_frame(s, p->decoder, frame, p->pcm, p->samples, p->clock_period);
+	if (adjust > 0) {
+		crossfade(p->pcm, p->pcm2, p->samples);
+	}
+	s->audio_buffer_head = frame + 1;
+	return ret;
+}
+
+// advances clock to the next tick after now, aligned to the frame boundaries shifted by delay1; after a late wakeup
+// the ticks that passed are played one after the other, instead of being skipped, as long as they are at most max_late
+// behind now, so that with short frames a scheduling hiccup doesn't always cost a frame
+static void next_tick(struct timespec *clock, struct timespec now, uint64_t clock_period, int64_t delay1, int64_t max_late) {
+	if (clock->tv_sec) {
+		int64_t late = (int64_t) (now.tv_sec - clock->tv_sec) * 1000000000 + now.tv_nsec - clock->tv_nsec - clock_period;
+		if (late >= 0 && late <= max_late) {
+			timeadd((*clock), clock_period);
+			return;
+		}
+	}
+	timeadd(now, clock_period);
+	timeadd(now, -delay1);
+	now.tv_nsec /= clock_period;
+	now.tv_nsec *= clock_period;
+	timeadd(now, delay1);
+	if (now.tv_sec < clock->tv_sec || (now.tv_sec == clock->tv_sec && now.tv_nsec <= clock->tv_nsec)) {
+		timeadd(now, clock_period);
+	}
+	*clock = now;
+}
+
+// the streams are split among the playback thread and the decode workers, each thread always decoding the same ones,
+// so that the buffers of each stream keep a single owner; decode_tick is the local time of the tick, delay included
+static struct timespec decode_tick;
+static pthread_barrier_t decode_start, decode_done;
+
+static void decode_streams(unsigned int first) {
+	for (unsigned int i = first; i < stream_count; i += decode_workers + 1) {
+		struct stream *s = &streams[i];
+		struct azz *currframe;
+		int64_t dequeued = monotonic_now();
+		while ((currframe = spsc_pop(&s->recv_queue))) {
+			histogram_add(&s->stats.recv_queue, dequeued - currframe->trace_time);
+			currframe->trace_time = dequeued;
+			playout_receive(s, currframe, s->server_time_diff);
+		}
+		struct timespec now = decode_tick;
+		timeadd(now, s->server_time_diff);
+		if (playout_tick(s, &now)) {
+			s->last_packet_clock = now;
+		}
+	}
+}
+
+static void *decode_worker_thread(void *arg) {
+	unsigned int first = (uintptr_t) arg;
+	printverbose("Decode worker thread %u started\n", first);
+	while (1) {
+		pthread_barrier_wait(&decode_start);
+		decode_streams(first);
+		pthread_barrier_wait(&decode_done);
+	}
+	pthread_exit(NULL);
+	return NULL;
+}
+
+// adds up the decoded frames of all the streams with their gains, saturating integer samples;
+// a single stream at unity gain is passed through as it is
+static void *mix_streams(float *mix, void *out, snd_pcm_uframes_t samples) {
+	if (stream_count == 1 && streams[0].gain == 1) {
+		return streams[0].playout.pcm;
+	}
+	size_t n = samples * channels;
+	memset(mix, 0, n * sizeof(float));
+	for (unsigned int i = 0; i < stream_count; i++) {
+		float gain = streams[i].gain;
+		if (use_float) {
+			float *pcm = streams[i].playout.pcm;
+			for (size_t j = 0; j < n; j++) {
+				mix[j] += pcm[j] * gain;
+			}
+		} else {
+			int16_t *pcm = streams[i].playout.pcm;
+			for (size_t j = 0; j < n; j++) {
+				mix[j] += pcm[j] * gain;
+			}
+		}
+	}
+	if (use_float) {
+		return mix;
+	}
+	for (size_t j = 0; j < n; j++) {
+		((int16_t *) out)[j] = mix[j] > 32767 ? 32767 : mix[j] < -32768 ? -32768 : lrintf(mix[j]);
+	}
+	return out;
+}
+
+static float output_gain() {
+	return pow(10, atomic_load_explicit(&volume_cdb, memory_order_relaxed) / 2000.0);
+}
+
+// the volume can be changed while playing by writing it in dB to the -Y file, which is read again once per second
+static void *volume_thread(void *arg) {
+	printverbose("Volume thread started\n");
+	double last = NAN;
+	while (1) {
+		FILE *f = fopen(volume_file, "r");
+		double volume;
+		if (f) {
+			if (fscanf(f, "%lf", &volume) == 1 && volume != last) {
+				printverbose("Volume set to %+.2f dB\n", volume);
+				atomic_store_explicit(&volume_cdb, lrint(volume * 100), memory_order_relaxed);
+				last = volume;
+			}
+			fclose(f);
+		}
+		sleep(1);
+	}
+	pthread_exit(NULL);
+	return NULL;
+}
+
+static void *audio_playback_thread(void *arg) {
+	printverbose("Audio playback thread started\n");
+
+	snd_pcm_uframes_t samples = (uint64_t) audio_packet_duration * rate / 1000000;
+	size_t pcm_size_multiplier = (use_float ? sizeof(float) : sizeof(int16_t)) * channels;
+	size_t pcm_size = samples * pcm_size_multiplier;
+	// the sound card or stdout might want wider integer samples, converted from float as the last stage,
+	// and a different number of channels than the decoded ones, out of the output DSP stage
+	int convert = sample_format_converted(sample_format);
+	unsigned long int out_channels = use_dsp ? dsp.out_channels : channels;
+	size_t output_size_multiplier = pcm_sample_size(sample_format) * out_channels;
+	uint64_t clock_period = (uint64_t) 1000 * audio_packet_duration;
+
 	struct timespec clock = {0, 0};
 
 	snd_pcm_t *snd = NULL;
 	snd_pcm_uframes_t buffer = samples;
 	int64_t delay2 = (int64_t) delay * -1000000;
+	int64_t alsa_delay = 0;
 	if (strcmp(device, "-") != 0) {
-		snd = snd_my_init(device, SND_PCM_STREAM_PLAYBACK, rate, channels, use_float, &buffer, buffermult);
-		delay2 += (int64_t) buffer * 1000000000 / rate;
+		snd = snd_my_init(device, SND_PCM_STREAM_PLAYBACK, rate, out_channels, sample_format, &buffer, buffermult);
+		alsa_delay = (int64_t) buffer * 1000000000 / rate;
+		delay2 += alsa_delay;
 		delay -= (int64_t) buffer * 1000 / rate;
 	}
+	void *silence = calloc(buffer, output_size_multiplier);
+	if (!silence) {
+		fprintf(stderr, "Could not allocate %lu bytes of memory!\n", buffer * output_size_multiplier);
+		exit(1);
+	}
 	int64_t delay1 = (int64_t) ((delay2 < 0 ? -delay2 : delay2) % clock_period) * (delay2 < 0 ? 1 : -1);
+	// whatever is still queued in the ALSA buffer covers for the ticks played late, while stdout can always be caught up on
+	int64_t max_late = snd ? alsa_delay - clock_period : (int64_t) delay * 1000000;
 
 	if (delay < 0) {
 		fprintf(stderr, "Total audio delay minus ALSA delay (%ld) cannot be negative.\n", delay);
 		exit(1);
 	}
 
-	pthread_barrier_wait(&init_barrier);
+	for (unsigned int i = 0; i < stream_count; i++) {
+		playout_init(&streams[i].playout, delay2, alsa_delay);
+	}
+	float *mix = alloca(samples * channels * sizeof(float));
+	void *mixed = alloca(pcm_size);
 
-	while (1) {
-		struct azz *currframe = NULL;
+	// the ALSA device clock drift is estimated from how its delay changes over time, and compensated by playing
+	// slightly more or fewer samples than received, keeping the delay at the average level of the first second
+	// after (re)starting with a PI controller; the ratio is limited to 0.5% which is way more than any real drift
+	snd_pcm_uframes_t resampled_max = samples + samples / 100 + 2;
+	void *resampled = alloca(resampled_max * pcm_size_multiplier);
+	float *resample_prev = alloca(channels * sizeof(float));
+	memset(resample_prev, 0, channels * sizeof(float));
+	void *dsp_out = use_dsp ? alloca(resampled_max * (use_float ? sizeof(float) : sizeof(int16_t)) * out_channels) : NULL;
+	void *converted = convert ? alloca(resampled_max * output_size_multiplier) : NULL;
+	double drift_delay = 0, drift_target = 0, drift_integ = 0, drift_ratio = 1;
+	int64_t drift_ticks = 0, drift_learn = 1000000000 / clock_period;
+	double drift_kp = (double) clock_period / 5e9, drift_ki = drift_kp * clock_period / 30e9;
+
+	pthread_barrier_wait(&init_barrier);
 
-		int64_t server_time_diff;
-		pthread_mutex_lock(&time_mutex);
-		server_time_diff = server_time_diff_global;
-		pthread_mutex_unlock(&time_mutex);
+	struct time_offset time_offset;
+	memset(&time_offset, 0, sizeof(time_offset));
 
+	while (1) {
+		// the ticks follow the clock of the first transmitter, the other streams play whatever frame is due on theirs at that time
 		struct timespec now;
 		clock_gettime(CLOCK_REALTIME, &now);
+		for (unsigned int i = 0; i < stream_count; i++) {
+			time_sync_read(&streams[i].time_sync, &time_offset);
+			streams[i].server_time_diff = time_offset_at(&time_offset, (int64_t) now.tv_sec * 1000000000 + now.tv_nsec);
+		}
+		int64_t server_time_diff = streams[0].server_time_diff;
 		timeadd(now, server_time_diff);
-		timeadd(now, clock_period);
-		timeadd(now, -delay1);
-		now.tv_nsec /= clock_period;
-		now.tv_nsec *= clock_period;
-		timeadd(now, delay1);
-		if (now.tv_sec < clock.tv_sec || (now.tv_sec == clock.tv_sec && now.tv_nsec <= clock.tv_nsec)) {
-			timeadd(now, clock_period);
-		}
-		clock = now;
+		next_tick(&clock, now, clock_period, delay1, max_late);
+		now = clock;
 		timeadd(now, -server_time_diff);
 		while (clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &now, NULL) == EINTR);
 		timeadd(now, server_time_diff);
@@ -90,19 +677,32 @@ static void *audio_playback_thread(void *arg) {
 			snd_pcm_avail_delay(snd, &availp, &delayp);
 			if (delayp < -1) {
 				printverbose("%d bad delayp %ld %ld, resetting\n", snd_pcm_state(snd), availp, delayp);
+				stat_inc(stats.alsa_resets);
 				snd_pcm_drop(snd);
 				snd_pcm_reset(snd);
 				snd_pcm_prepare(snd);
+				drift_ticks = 0;
 				continue;
 			}
-			if (snd_pcm_state(snd) == 2) {
-				void *pcm2 = calloc(buffer, pcm_size_multiplier);
-				if (!pcm2) {
-					fprintf(stderr, "Could not allocate %lu bytes of memory!\n", buffer * pcm_size_multiplier);
-					exit(1);
+			if (snd_pcm_state(snd) == SND_PCM_STATE_PREPARED) {
+				snd_my_writei(snd, silence, buffer);
+				drift_ticks = 0;
+			} else if (drift_comp) {
+				if (drift_ticks == 0) {
+					drift_delay = delayp;
+					drift_target = 0;
+					drift_integ = 0;
+				}
+				drift_delay += (delayp - drift_delay) / 16;
+				if (++drift_ticks <= drift_learn) {
+					drift_target += (double) delayp / drift_learn;
+				} else {
+					double error = (drift_delay - drift_target) / samples;
+					drift_integ += error * drift_ki;
+					drift_ratio = 1 + error * drift_kp + drift_integ;
+					drift_ratio = drift_ratio < 0.995 ? 0.995 : drift_ratio > 1.005 ? 1.005 : drift_ratio;
+					stat_set(stats.drift_ppm, lrint((drift_ratio - 1) * 1e6));
 				}
-				snd_pcm_writei(snd, pcm2, buffer);
-				free(pcm2);
 			}
 		}
 
@@ -110,71 +710,103 @@ static void *audio_playback_thread(void *arg) {
 			struct timespec now2;
 			clock_gettime(CLOCK_REALTIME, &now2);
 			timeadd(now2, server_time_diff);
-			printverbose("%d clock %ld.%09lu now2 %ld.%09lu, avail_delay %6ld %6ld %6ld, delay %"PRId64" %"PRId64"\n", snd_pcm_state(snd), now.tv_sec, now.tv_nsec, now2.tv_sec, now2.tv_nsec, availp, delayp, availp + delayp, delay1, delay2);
+			printverbose("%d clock %ld.%09lu now2 %ld.%09lu, avail_delay %6ld %6ld %6ld, delay %"PRId64" %"PRId64", drift %+.1f ppm\n", snd_pcm_state(snd), now.tv_sec, now.tv_nsec, now2.tv_sec, now2.tv_nsec, availp, delayp, availp + delayp, delay1, delay2, (drift_ratio - 1) * 1e6);
 		}
 
-		pthread_mutex_lock(&audio_mutex);
-		while (audio_buffer) {
-			if (audio_buffer->packet.tv_sec == now.tv_sec && audio_buffer->packet.tv_nsec == now.tv_nsec) {
-				printverbose("got packet %"PRIi64".%09"PRIu32"\n", audio_buffer->packet.tv_sec, audio_buffer->packet.tv_nsec);
-				currframe = audio_buffer;
-				audio_buffer = audio_buffer->next;
-				last_packet_clock = now;
-				break;
-			} else if (audio_buffer->packet.tv_sec > now.tv_sec || (audio_buffer->packet.tv_sec == now.tv_sec && audio_buffer->packet.tv_nsec > now.tv_nsec)) {
-				//printverbose("future packet %"PRIi64".%09"PRIu32"\n", audio_buffer->packet.tv_sec, audio_buffer->packet.tv_nsec);
-				break;
-			} else {
-				printverbose("skipping packet %"PRIi64".%09"PRIu32"\n", audio_buffer->packet.tv_sec, audio_buffer->packet.tv_nsec);
-				currframe = audio_buffer;
-				audio_buffer = audio_buffer->next;
-				free(currframe);
-				currframe = NULL;
-			}
+		// the last stage writes straight into the ring buffer of the device when possible: the format conversion if needed,
+		// otherwise the output DSP, the resampler if enabled, the mixer, or even the decoder when there is a single stream
+		// to be played as it is
+		void *ring = NULL;
+		snd_pcm_uframes_t ring_offset = 0;
+		snd_pcm_sframes_t ring_ret = 0;
+		if (snd != NULL && use_mmap) {
+			ring = snd_my_mmap_begin(snd, drift_comp ? resampled_max : samples, &ring_offset, &ring_ret);
 		}
-		pthread_mutex_unlock(&audio_mutex);
-
-		int r;
-		if (currframe) {
-			if (use_float) {
-				r = opus_decode_float(decoder, &currframe->packet.data, currframe->datalen, pcm, samples, 0);
-			} else {
-				r = opus_decode(decoder, &currframe->packet.data, currframe->datalen, pcm, samples, 0);
-			}
-			free(currframe);
-		} else {
-			printverbose("no packet received!\n");
-			r = opus_decode(decoder, NULL, 0, pcm, samples, 1);
+		void *direct = convert || use_dsp ? NULL : ring;
+		void *pcm_direct = streams[0].playout.pcm;
+		if (direct && !drift_comp && stream_count == 1 && streams[0].gain == 1) {
+			streams[0].playout.pcm = ring;
 		}
 
-		if (r != samples) {
-			fprintf(stderr, "opus_decode: %s\n", opus_strerror(r));
-			exit(1);
+		decode_tick = now;
+		timeadd(decode_tick, -server_time_diff);
+		if (decode_workers) {
+			pthread_barrier_wait(&decode_start);
+		}
+		decode_streams(0);
+		if (decode_workers) {
+			pthread_barrier_wait(&decode_done);
+		}
+		int64_t decoded = monotonic_now();
+		void *pcm;
+		if (direct && !drift_comp) {
+			pcm = mix_streams(use_float ? ring : mix, ring, samples);
+		} else {
+			pcm = mix_streams(mix, mixed, samples);
 		}
+		streams[0].playout.pcm = pcm_direct;
 
 		if (snd != NULL) {
-			int retval = snd_pcm_writei(snd, pcm, samples);
+			void *pcm_out = pcm;
+			snd_pcm_uframes_t samples_out = samples;
+			if (drift_comp) {
+				// a delay higher than the target means the device is slower than the transmitter, so the step gets bigger
+				samples_out = resample(direct ? ring : resampled, pcm, resample_prev, samples, drift_ratio);
+				pcm_out = resampled;
+			}
+			if (use_dsp) {
+				dsp_process(&dsp, ring && !convert ? ring : dsp_out, pcm_out, samples_out, output_gain(), !use_float);
+				pcm_out = dsp_out;
+			}
+			if (convert) {
+				pcm_from_float(ring ? ring : converted, pcm_out, samples_out * out_channels, sample_format);
+				pcm_out = converted;
+			}
+			int retval;
+			if (ring) {
+				retval = snd_pcm_mmap_commit(snd, ring_offset, samples_out);
+			} else if (ring_ret < 0) {
+				retval = ring_ret;
+			} else {
+				retval = snd_my_writei(snd, pcm_out, samples_out);
+			}
 			if (retval == -11) {
 				printverbose("Zero write, %d < %lu\n", retval, samples);
+				stat_inc(stats.alsa_zero_writes);
 				if (availp == samples - 1) {
 					snd_pcm_prepare(snd);
 				}
 			} else if (retval < 0) {
 				printverbose("recovering %d\n", retval);
+				stat_inc(stats.alsa_recoveries);
 				snd_callcheck2(snd_pcm_recover, "snd_pcm_writei", retval, snd, retval, 0);
-			} else if (retval != samples) {
-				printverbose("Short write, %d != %lu\n", retval, samples);
+			} else if (retval != samples_out) {
+				printverbose("Short write, %d != %lu\n", retval, samples_out);
+				stat_inc(stats.alsa_short_writes);
+			}
+			histogram_add(&stats.output_time, monotonic_now() - decoded);
+			if (delayp >= 0) {
+				histogram_add(&stats.alsa_delay, (int64_t) delayp * 1000000000 / rate);
 			}
 		} else {
+			if (use_dsp) {
+				dsp_process(&dsp, dsp_out, pcm, samples, output_gain(), !use_float);
+				pcm = dsp_out;
+			}
+			if (convert) {
+				pcm_from_float(converted, pcm, samples * out_channels, sample_format);
+				pcm = converted;
+			}
 			int f = 0;
-			while (f < pcm_size) {
-				int f2 = write(1, (uint8_t *) pcm + f, pcm_size - f);
+			while (f < samples * output_size_multiplier) {
+				int f2 = write(1, (uint8_t *) pcm + f, samples * output_size_multiplier - f);
 				if (f2 <= 0) {
 					fprintf(stderr, "Error while writing audio to stdout, %d, %d %s\n", f2, errno, strerror(errno));
 					exit(1);
 				}
 				f += f2;
 			}
+			histogram_add(&stats.output_time, monotonic_now() - decoded);
 		}
 	}
 
@@ -183,20 +815,727 @@ static void *audio_playback_thread(void *arg) {
 	if (snd && snd_pcm_close(snd) < 0)
 		abort();
 
-	opus_decoder_destroy(decoder);
+	free(silence);
+
+	for (unsigned int i = 0; i < stream_count; i++) {
+		playout_destroy(&streams[i].playout);
+	}
 
-	pthread_mutex_destroy(&audio_mutex);
-	pthread_mutex_destroy(&time_mutex);
 	pthread_exit(NULL);
 	return NULL;
 }
 
+static void record_packet(void *packet, int len, int64_t recv_time, int64_t offset) {
+	struct recordp record;
+	record.recv_time = htobe64(recv_time);
+	record.offset = htobe64(offset);
+	record.len = htobe16(len);
+	if (fwrite(&record, sizeof(record), 1, record_file) != 1 || fwrite(packet, len, 1, record_file) != 1) {
+		fprintf(stderr, "Error while writing to %s: %s\n", record_path, strerror(errno));
+		exit(1);
+	}
+}
+
+// works out the frame number of a received packet, whose header is already in host byte order
+static int frame_prepare(struct stream *s, struct azz *currframe, uint64_t clock_period) {
+	currframe->frame = frame_number(currframe->packet.tv_sec, currframe->packet.tv_nsec & ~PARITY_FLAG, clock_period);
+	if (currframe->frame < 0) {
+		fprintf(stderr, "Received frame %"PRIi64".%09"PRIu32" with invalid timestamp\n", currframe->packet.tv_sec, currframe->packet.tv_nsec);
+		stat_inc(s->stats.invalid);
+		return 0;
+	}
+	return 1;
+}
+
+// the Opus frames making up one frame of audio_packet_duration: libopus codes 40 and 60 ms ones in CELT mode as two or
+// three frames of 20 ms
+static int packet_frames_per_frame(const unsigned char *data, uint64_t clock_period) {
+	int samples = opus_packet_get_samples_per_frame(data, rate);
+	int k = samples > 0 ? (int) (clock_period * rate / 1000000000 / samples) : 1;
+	return k > 0 ? k : 1;
+}
+
+// takes apart a packet of several frames, leaving the first one in currframe and putting the others in slots taken from the
+// free queue, or from the spare ones the receive thread didn't need in this round, which are returned in frames; they get
+// the timestamps the transmitter gave them when it put them together, the frames that don't fit in the buffer are dropped;
+// returns the number of slots taken
+static unsigned int packet_split(struct stream *s, struct azz *currframe, struct azz **frames, struct azz **spare, unsigned int spare_count, uint64_t clock_period) {
+	if (currframe->packet.tv_nsec & PARITY_FLAG) {
+		return 0;
+	}
+	int count = opus_packet_get_nb_frames(&currframe->packet.data, currframe->datalen);
+	if (count <= 1) {
+		return 0;
+	}
+	int k = packet_frames_per_frame(&currframe->packet.data, clock_period);
+	if (count <= k || opus_repacketizer_cat(opus_repacketizer_init(s->repacketizer), &currframe->packet.data, currframe->datalen) != OPUS_OK) {
+		return 0;
+	}
+	count /= k;
+	stat_add(s->stats.bundled, count);
+
+	// the first frame is written over the packet last, since the repacketizer reads the others from there
+	unsigned int n = 0;
+	for (int i = 1; i < count; i++) {
+		struct azz *frame = spsc_pop(&s->free_queue);
+		while (!frame && spare_count) {
+			frame = spare[--spare_count];
+			spare[spare_count] = NULL;
+		}
+		if (!frame) {
+			fprintf(stderr, "Audio buffer full, dropping frame %"PRIi64"\n", currframe->frame + i);
+			stat_inc(s->stats.dropped);
+			continue;
+		}
+		struct timespec ts;
+		frame->frame = currframe->frame + i;
+		frame->recv_time = currframe->recv_time;
+		frame->trace_time = currframe->trace_time;
+		frame->datalen = opus_repacketizer_out_range(s->repacketizer, i * k, (i + 1) * k, &frame->packet.data, MAX_PAYLOAD_SIZE);
+		frame_timestamp(frame->frame, clock_period, &ts);
+		frame->packet.tv_sec = ts.tv_sec;
+		frame->packet.tv_nsec = ts.tv_nsec;
+		frames[n++] = frame;
+	}
+	currframe->datalen = opus_repacketizer_out_range(s->repacketizer, 0, k, &currframe->packet.data, MAX_PAYLOAD_SIZE);
+	return n;
+}
+
+// works out the timestamp in a compact header, unwrapping it with the transmitter clock at the time the packet was
+// received, which only needs to be right to within 12 hours; the transmitter rounded it up to a whole sample,
+// so rounding down gets back into the same frame
+static void header_timestamp(struct hdrp *hdr, int64_t transmitter_time, int64_t *tv_sec, uint32_t *tv_nsec) {
+	int64_t now = transmitter_time / 1000000000 * rate + transmitter_time % 1000000000 * rate / 1000000000;
+	int64_t ts = now + (int32_t) (be32toh(hdr->ts) - (uint32_t) now);
+	*tv_sec = ts / rate;
+	*tv_nsec = ts % rate * 1000000000 / rate;
+}
+
+// turns the header of a received packet into the legacy one in host byte order, which is what everything else works
+// with, moving the payload right after it if the packet has the compact header; packets with the legacy header,
+// which has no stream id, are taken by every stream; returns 0 for packets to ignore
+static int packet_header_read(struct stream *s, struct azz *currframe, int compact, int64_t offset) {
+	if (!compact) {
+		currframe->datalen -= sizeof(struct timep);
+		currframe->packet.tv_sec = be64toh(currframe->packet.tv_sec);
+		currframe->packet.tv_nsec = be32toh(currframe->packet.tv_nsec);
+		return 1;
+	}
+	struct hdrp hdr;
+	memcpy(&hdr, &currframe->packet, offsetof(struct hdrp, data));
+	if (hdr.magic != (HEADER_MAGIC | HEADER_VERSION)) {
+		fprintf(stderr, "Received packet with unknown header version %u, dropping it\n", hdr.magic & 0x0f);
+		stat_inc(s->stats.invalid);
+		return 0;
+	}
+	if ((hdr.stream & ~HEADER_PARITY) != s->id) {
+		stat_inc(s->stats.other_stream);
+		return 0;
+	}
+
+	// gaps in the sequence are counted when they show up and the packets filling them when they arrive, so that losses
+	// on the network can be told from reordering; a jump back by more than the buffer is a restarted transmitter
+	uint16_t seq = be16toh(hdr.seq);
+	int16_t gap = seq - s->seq_next;
+	if (s->seq_started && gap < 0 && gap >= -(int) audio_buffer_size) {
+		stat_inc(s->stats.seq_reordered);
+	} else {
+		if (s->seq_started && gap > 0) {
+			stat_add(s->stats.seq_gaps, gap);
+		}
+		s->seq_next = seq + 1;
+		s->seq_started = 1;
+	}
+
+	currframe->datalen -= offsetof(struct hdrp, data);
+	memmove(&currframe->packet.data, (uint8_t *) &currframe->packet + offsetof(struct hdrp, data), currframe->datalen);
+	int64_t tv_sec;
+	uint32_t tv_nsec;
+	header_timestamp(&hdr, currframe->recv_time + offset, &tv_sec, &tv_nsec);
+	currframe->packet.tv_sec = tv_sec;
+	currframe->packet.tv_nsec = tv_nsec | (hdr.stream & HEADER_PARITY ? PARITY_FLAG : 0);
+	return 1;
+}
+
+// datagrams to replay, as received on the wire, with their arrival time on the transmitter clock;
+// lost ones are kept with no data so that the order of the random numbers never changes
+struct replay_packet {
+	int64_t arrival;
+	size_t seq;
+	uint16_t len;
+	uint8_t *data;
+};
+
+static struct replay_packet *replay_packets = NULL;
+static size_t replay_count = 0, replay_alloc = 0;
+static unsigned long int replay_reordered = 0, replay_duplicated = 0;
+
+static struct replay_packet *replay_add(int64_t arrival, uint16_t len) {
+	if (replay_count == replay_alloc) {
+		replay_alloc = replay_alloc ? replay_alloc * 2 : 1024;
+		replay_packets = realloc(replay_packets, replay_alloc * sizeof(struct replay_packet));
+		if (!replay_packets) {
+			fprintf(stderr, "Could not allocate %lu bytes of memory!\n", (unsigned long int) (replay_alloc * sizeof(struct replay_packet)));
+			exit(1);
+		}
+	}
+	struct replay_packet *rp = &replay_packets[replay_count];
+	rp->arrival = arrival;
+	rp->seq = replay_count++;
+	rp->len = len;
+	rp->data = malloc(len ? len : 1);
+	if (!rp->data) {
+		fprintf(stderr, "Could not allocate %lu bytes of memory!\n", (unsigned long int) len);
+		exit(1);
+	}
+	return rp;
+}
+
+static void replay_load(char *path) {
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		exit(1);
+	}
+	char magic[sizeof(RECORD_MAGIC) - 1];
+	if (fread(magic, sizeof(magic), 1, f) != 1 || memcmp(magic, RECORD_MAGIC, sizeof(magic)) != 0) {
+		fprintf(stderr, "%s is not a mrx recording\n", path);
+		exit(1);
+	}
+	struct recordp record;
+	while (fread(&record, sizeof(record), 1, f) == 1) {
+		struct replay_packet *rp = replay_add((int64_t) be64toh(record.recv_time) + (int64_t) be64toh(record.offset), be16toh(record.len));
+		if (fread(rp->data, rp->len, 1, f) != 1) {
+			fprintf(stderr, "%s: last record is truncated, ignoring it\n", path);
+			free(rp->data);
+			replay_count--;
+			break;
+		}
+	}
+	fclose(f);
+}
+
+// the stream mtx would send for a couple of tones, at its default bitrate, with each packet arriving 1 ms after its timestamp;
+// it starts at a fixed time so that replays are the same every time
+static void replay_synth(unsigned long int seconds, uint64_t clock_period) {
+	snd_pcm_uframes_t samples = (uint64_t) audio_packet_duration * rate / 1000000;
+	size_t bytes_per_frame = 128 * audio_packet_duration / 8000;
+
+	int error;
+	OpusEncoder *encoder = opus_encoder_create(rate, channels, OPUS_APPLICATION_AUDIO, &error);
+	if (encoder == NULL) {
+		fprintf(stderr, "opus_encoder_create: %s\n", opus_strerror(error));
+		exit(1);
+	}
+	opus_encoder_ctl(encoder, OPUS_SET_BITRATE(128000));
+
+	float *pcm = malloc(samples * channels * sizeof(float));
+	unsigned char *data = malloc(bytes_per_frame);
+	if (!pcm || !data) {
+		fprintf(stderr, "Could not allocate %lu bytes of memory!\n", (unsigned long int) (samples * channels * sizeof(float) + bytes_per_frame));
+		exit(1);
+	}
+
+	int64_t first = frame_number(1500000000, 0, clock_period);
+	int64_t frames = (int64_t) seconds * 1000000000 / clock_period;
+	for (int64_t i = 0; i < frames; i++) {
+		for (snd_pcm_uframes_t n = 0; n < samples; n++) {
+			for (unsigned long int c = 0; c < channels; c++) {
+				pcm[n * channels + c] = 0.25 * sin(2 * M_PI * 440 * (c + 1) * (i * samples + n) / rate);
+			}
+		}
+		int z = opus_encode_float(encoder, pcm, samples, data, bytes_per_frame);
+		if (z < 0) {
+			fprintf(stderr, "opus_encode: %s\n", opus_strerror(z));
+			exit(1);
+		}
+
+		struct timespec ts;
+		frame_timestamp(first + i, clock_period, &ts);
+		struct replay_packet *rp = replay_add((int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec + 1000000, sizeof(struct timep) + z);
+		struct azzp *packet = (struct azzp *) rp->data;
+		packet->tv_sec = htobe64(ts.tv_sec);
+		packet->tv_nsec = htobe32(ts.tv_nsec);
+		memcpy(&packet->data, data, z);
+	}
+
+	free(pcm);
+	free(data);
+	opus_encoder_destroy(encoder);
+}
+
+// applies the simulated network impairments, always with the same random numbers
+static void replay_impair(struct stream *s, uint64_t clock_period) {
+	unsigned int seed = 1, loss_left = 0;
+	size_t count = replay_count;
+	for (size_t i = 0; i < count; i++) {
+		if (loss_left || (sim_loss && rand_r(&seed) % (100 * sim_loss_burst) < sim_loss)) {
+			loss_left = loss_left ? loss_left - 1 : sim_loss_burst - 1;
+			stat_inc(s->stats.simulated_loss);
+			free(replay_packets[i].data);
+			replay_packets[i].data = NULL;
+			continue;
+		}
+		if (sim_reorder && rand_r(&seed) % 100 < sim_reorder) {
+			// late enough to arrive after the next one to three packets
+			replay_packets[i].arrival += clock_period * (1 + rand_r(&seed) % 3);
+			replay_reordered++;
+		}
+		if (sim_jitter) {
+			replay_packets[i].arrival += rand_r(&seed) % (sim_jitter * 1000000);
+		}
+		if (sim_dup && rand_r(&seed) % 100 < sim_dup) {
+			struct replay_packet *rp = replay_add(replay_packets[i].arrival + rand_r(&seed) % clock_period, replay_packets[i].len);
+			memcpy(rp->data, replay_packets[i].data, rp->len);
+			replay_duplicated++;
+		}
+	}
+}
+
+static int replay_compare(const void *a, const void *b) {
+	const struct replay_packet *rp1 = a, *rp2 = b;
+	if (rp1->arrival != rp2->arrival) {
+		return rp1->arrival < rp2->arrival ? -1 : 1;
+	}
+	return rp1->seq < rp2->seq ? -1 : rp1->seq > rp2->seq;
+}
+
+// hands a packet over to the playout the same way the receive thread does
+static void replay_feed(struct stream *s, struct replay_packet *rp, uint64_t clock_period) {
+	if (!rp->data) {
+		return;
+	}
+	stat_inc(s->stats.received);
+	int compact = packet_is_compact(rp->data, rp->len);
+	if (rp->len <= (compact ? offsetof(struct hdrp, data) : sizeof(struct timep)) || rp->len > sizeof(struct timep) + MAX_PAYLOAD_SIZE) {
+		fprintf(stderr, "Replayed packet has an invalid length (%u bytes), dropping it\n", rp->len);
+		stat_inc(s->stats.invalid);
+		return;
+	}
+	struct azz *currframe = spsc_pop(&s->free_queue);
+	if (!currframe) {
+		fprintf(stderr, "Audio buffer full, dropping replayed packet\n");
+		stat_inc(s->stats.dropped);
+		return;
+	}
+	memcpy(&currframe->packet, rp->data, rp->len);
+	currframe->datalen = rp->len;
+	// the arrival time is already on the transmitter clock
+	currframe->recv_time = rp->arrival;
+	currframe->trace_time = monotonic_now();
+	// time replies are recorded too, but there is nothing to do with them here
+	if (!packet_header_read(s, currframe, compact, 0) || (!compact && currframe->datalen == sizeof(struct timep) && !(currframe->packet.tv_nsec & PARITY_FLAG)) || !frame_prepare(s, currframe, clock_period)) {
+		spsc_push(&s->free_queue, currframe);
+		return;
+	}
+	struct azz *frames[48];
+	unsigned int split = packet_split(s, currframe, frames, NULL, 0, clock_period);
+	playout_receive(s, currframe, 0);
+	for (unsigned int j = 0; j < split; j++) {
+		playout_receive(s, frames[j], 0);
+	}
+}
+
+// runs the playout on a virtual clock as fast as possible, from the first frame to the last one
+static void replay(struct stream *s, char *source) {
+	uint64_t clock_period = (uint64_t) 1000 * audio_packet_duration;
+	if (strncmp(source, "synth", 5) == 0 && (source[5] == '\0' || source[5] == ':')) {
+		replay_synth(source[5] == ':' ? strtoul(source + 6, NULL, 10) : 60, clock_period);
+	} else {
+		replay_load(source);
+	}
+	replay_impair(s, clock_period);
+	qsort(replay_packets, replay_count, sizeof(struct replay_packet), replay_compare);
+
+	int64_t first_ts = INT64_MAX, last_ts = INT64_MIN;
+	for (size_t i = 0; i < replay_count; i++) {
+		struct azzp *packet = (struct azzp *) replay_packets[i].data;
+		struct hdrp *hdr = (struct hdrp *) packet;
+		int64_t tv_sec;
+		uint32_t tv_nsec;
+		unsigned char *data;
+		size_t len;
+		if (!packet) {
+			continue;
+		} else if (packet_is_compact(packet, replay_packets[i].len)) {
+			if (hdr->magic != (HEADER_MAGIC | HEADER_VERSION) || hdr->stream != s->id) {
+				continue;
+			}
+			header_timestamp(hdr, replay_packets[i].arrival, &tv_sec, &tv_nsec);
+			data = &hdr->data;
+			len = replay_packets[i].len - offsetof(struct hdrp, data);
+		} else if (replay_packets[i].len > sizeof(struct timep) && replay_packets[i].len != sizeof(struct timep2) && !(be32toh(packet->tv_nsec) & PARITY_FLAG)) {
+			tv_sec = be64toh(packet->tv_sec);
+			tv_nsec = be32toh(packet->tv_nsec);
+			data = &packet->data;
+			len = replay_packets[i].len - sizeof(struct timep);
+		} else {
+			continue;
+		}
+		int count = opus_packet_get_nb_frames(data, len);
+		if (count > 1) {
+			count /= packet_frames_per_frame(data, clock_period);
+		}
+		int64_t ts = tv_sec * 1000000000 + tv_nsec;
+		first_ts = ts < first_ts ? ts : first_ts;
+		// up to the last frame of packets with several ones
+		if (count > 1) {
+			struct timespec last;
+			frame_timestamp(frame_number(tv_sec, tv_nsec, clock_period) + count - 1, clock_period, &last);
+			ts = (int64_t) last.tv_sec * 1000000000 + last.tv_nsec;
+		}
+		last_ts = ts > last_ts ? ts : last_ts;
+	}
+	if (first_ts > last_ts) {
+		fprintf(stderr, "Nothing to replay\n");
+		exit(1);
+	}
+
+	int64_t delay2 = (int64_t) delay * -1000000;
+	int64_t delay1 = (int64_t) (-delay2 % clock_period);
+	struct playout *playout = &s->playout;
+	playout_init(playout, delay2, 0);
+	unsigned long int out_channels = use_dsp ? dsp.out_channels : channels;
+	size_t pcm_size = playout->samples * pcm_sample_size(sample_format) * out_channels;
+	void *dsp_out = use_dsp ? alloca(playout->samples * (use_float ? sizeof(float) : sizeof(int16_t)) * out_channels) : NULL;
+	void *converted = sample_format_converted(sample_format) ? alloca(pcm_size) : NULL;
+	int to_stdout = strcmp(device, "-") == 0;
+
+	// the first tick is the one playing the first frame
+	struct timespec clock = {0, 0}, now;
+	now.tv_sec = (first_ts - delay2 - 1) / 1000000000;
+	now.tv_nsec = (first_ts - delay2 - 1) % 1000000000;
+
+	struct histogram tick_time;
+	memset(&tick_time, 0, sizeof(tick_time));
+	int64_t frames = 0, cpu_total = 0, cpu_max = 0;
+	struct timespec wall1, wall2;
+	clock_gettime(CLOCK_MONOTONIC, &wall1);
+
+	size_t next = 0;
+	while (1) {
+		next_tick(&clock, now, clock_period, delay1, 0);
+		now = clock;
+		int64_t wake = (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+		if (wake + delay2 > last_ts) {
+			break;
+		}
+
+		struct timespec t1, t2;
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t1);
+		while (next < replay_count && replay_packets[next].arrival <= wake) {
+			replay_feed(s, &replay_packets[next++], clock_period);
+		}
+		timeadd(now, delay2);
+		playout_tick(s, &now);
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t2);
+		int64_t cpu = (int64_t) (t2.tv_sec - t1.tv_sec) * 1000000000 + t2.tv_nsec - t1.tv_nsec;
+		histogram_add(&tick_time, cpu);
+		cpu_total += cpu;
+		cpu_max = cpu > cpu_max ? cpu : cpu_max;
+		frames++;
+		now = clock;
+
+		if (to_stdout) {
+			void *pcm = playout->pcm;
+			if (use_dsp) {
+				dsp_process(&dsp, dsp_out, pcm, playout->samples, output_gain(), !use_float);
+				pcm = dsp_out;
+			}
+			if (converted) {
+				pcm_from_float(converted, pcm, playout->samples * out_channels, sample_format);
+				pcm = converted;
+			}
+			int f = 0;
+			while (f < pcm_size) {
+				int f2 = write(1, (uint8_t *) pcm + f, pcm_size - f);
+				if (f2 <= 0) {
+					fprintf(stderr, "Error while writing audio to stdout, %d, %d %s\n", f2, errno, strerror(errno));
+					exit(1);
+				}
+				f += f2;
+			}
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &wall2);
+	double wall = (wall2.tv_sec - wall1.tv_sec) + (wall2.tv_nsec - wall1.tv_nsec) / 1e9;
+	double audio = (double) frames * clock_period / 1e9;
+
+	fprintf(stderr, "Replayed %"PRIi64" frames (%.3f s of audio) in %.3f s, %.1fx realtime\n", frames, audio, wall, audio / wall);
+	fprintf(stderr, "Injected %ld lost, %lu reordered and %lu duplicated packets, with up to %lu ms of jitter\n", (long int) s->stats.simulated_loss, replay_reordered, replay_duplicated, sim_jitter);
+	fprintf(stderr, "Received %ld packets: %ld late, %ld duplicated, %ld too far in the future, %ld dropped, %ld invalid\n", (long int) s->stats.received, (long int) s->stats.late, (long int) s->stats.duplicated, (long int) s->stats.future, (long int) s->stats.dropped, (long int) s->stats.invalid);
+	fprintf(stderr, "Lost frames: %ld concealed, %ld recovered from parity, %ld from FEC\n", (long int) s->stats.concealed, (long int) s->stats.parity_recovered, (long int) s->stats.fec_recovered);
+	if (playout->advance_max) {
+		fprintf(stderr, "Adaptive delay: %ld frames inserted, %ld skipped, ending at %"PRIi64" ms\n", (long int) s->stats.adaptive_inserted, (long int) s->stats.adaptive_skipped, (-delay2 - playout->advance * (int64_t) clock_period) / 1000000);
+	}
+	fprintf(stderr, "CPU time per frame: %.1f us average, %.1f us max\n", frames ? cpu_total / 1e3 / frames : 0, cpu_max / 1e3);
+	fprintf(stderr, "# histogram of power of two buckets of microseconds: <1 <2 <4 <8 ...\n");
+	histogram_print(stderr, "", "cpu_time", &tick_time);
+
+	playout_destroy(playout);
+	for (size_t i = 0; i < replay_count; i++) {
+		free(replay_packets[i].data);
+	}
+	free(replay_packets);
+}
+
+// one slot for each frame that may be waiting to be played, plus some headroom,
+// the same amount again for parity packets and for the ones being handed over to the thread decoding the stream,
+// plus the one used to recover lost frames and the one used to drop packets when the decoding thread is stuck
+static void stream_init(struct stream *s) {
+	size_t slot_size = (offsetof(struct azz, packet.data) + MAX_PAYLOAD_SIZE + 7) & ~(size_t) 7;
+	s->audio_buffer = calloc(audio_buffer_size, sizeof(struct azz *));
+	s->parity_buffer = calloc(audio_buffer_size, sizeof(struct azz *));
+	s->recv_frames = calloc(recv_batch, sizeof(struct azz *));
+	uint8_t *slab = calloc(audio_buffer_size * 3 + 2, slot_size);
+	if (!s->audio_buffer || !s->parity_buffer || !s->recv_frames || !slab) {
+		fprintf(stderr, "Could not allocate %lu bytes of memory!\n", (unsigned long int) (audio_buffer_size * 2 * sizeof(struct azz *) + recv_batch * sizeof(struct azz *) + (audio_buffer_size * 3 + 2) * slot_size));
+		exit(1);
+	}
+	spsc_init(&s->recv_queue, audio_buffer_size);
+	spsc_init(&s->free_queue, audio_buffer_size);
+	for (unsigned int i = 0; i < audio_buffer_size * 3 + 2; i++) {
+		struct azz *frame = (struct azz *) (slab + i * slot_size);
+		frame->frame = -1;
+		if (i < audio_buffer_size) {
+			s->audio_buffer[i] = frame;
+		} else if (i < audio_buffer_size * 2) {
+			s->parity_buffer[i - audio_buffer_size] = frame;
+		} else if (i < audio_buffer_size * 3) {
+			spsc_push(&s->free_queue, frame);
+		} else if (i == audio_buffer_size * 3) {
+			s->play_frame = frame;
+		} else {
+			s->drop_frame = frame;
+		}
+	}
+	s->repacketizer = opus_repacketizer_create();
+	if (!s->repacketizer) {
+		fprintf(stderr, "Could not allocate %lu bytes of memory!\n", (unsigned long int) opus_repacketizer_get_size());
+		exit(1);
+	}
+	s->gain = 1;
+}
+
+// scratch space of the receive thread, shared by all the streams
+static struct mmsghdr *recv_msgs = NULL;
+static struct iovec *recv_iovs = NULL;
+static struct sockaddr_in *recv_addrins = NULL;
+static uint8_t *recv_cmsgs = NULL;
+static size_t recv_cmsg_size = 0;
+static unsigned int sim_loss_seed = 0, sim_loss_left = 0;
+// an Opus packet has at most 48 frames
+static struct azz *split_frames[48];
+
+// the first request has no report, since the frames played before receiving anything from the transmitter don't count
+static int report_fill(struct stream *s, struct reportp *report) {
+	struct reportp now;
+	now.frames = atomic_load_explicit(&s->stats.played, memory_order_relaxed);
+	now.lost = atomic_load_explicit(&s->stats.parity_recovered, memory_order_relaxed) + atomic_load_explicit(&s->stats.fec_recovered, memory_order_relaxed) + atomic_load_explicit(&s->stats.concealed, memory_order_relaxed);
+	now.late = atomic_load_explicit(&s->stats.late, memory_order_relaxed);
+	report->frames = htobe32(now.frames - s->last_report.frames);
+	report->lost = htobe32(now.lost - s->last_report.lost);
+	report->late = htobe32(now.late - s->last_report.late);
+	s->last_report = now;
+	int ret = s->reporting;
+	s->reporting = 1;
+	return ret;
+}
+
+// takes the replies to the time requests of the stream, if any came, and feeds them to its clock offset estimator
+static void time_receive(struct stream *s) {
+	while (1) {
+		struct timep2 timepacket;
+		struct sockaddr_in addrin;
+		struct iovec iov = {&timepacket, sizeof(timepacket)};
+		char control[CMSG_SPACE(sizeof(struct timespec))];
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_name = &addrin;
+		msg.msg_namelen = sizeof(addrin);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		errno = 0;
+		int plen = recvmsg(s->time_sock, &msg, MSG_DONTWAIT);
+		if (plen < 0) {
+			if (errno != EINTR && errno != EAGAIN) {
+				perror("recvmsg");
+			}
+			return;
+		}
+
+		struct timespec time_recv;
+		struct cmsghdr *cmsg;
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+				memcpy(&time_recv, CMSG_DATA(cmsg), sizeof(struct timespec));
+				break;
+			}
+		}
+		if (!cmsg) {
+			clock_gettime(CLOCK_REALTIME, &time_recv);
+		}
+
+		struct timespec *last_time_sent = &s->last_time_sent;
+		if (plen != sizeof(struct timep2) || last_time_sent->tv_sec == 0 || (int64_t) be64toh(timepacket.t1.tv_sec) != last_time_sent->tv_sec || be32toh(timepacket.t1.tv_nsec) != last_time_sent->tv_nsec) {
+			fprintf(stderr, "Invalid time packet received!\n");
+			stat_inc(s->stats.invalid);
+			continue;
+		}
+		struct timespec time_serv;
+		time_serv.tv_sec = be64toh(timepacket.t2.tv_sec);
+		time_serv.tv_nsec = be32toh(timepacket.t2.tv_nsec);
+
+		time_sync_update(&s->time_sync, (int64_t) last_time_sent->tv_sec * 1000000000 + last_time_sent->tv_nsec, (int64_t) time_serv.tv_sec * 1000000000 + time_serv.tv_nsec, (int64_t) time_recv.tv_sec * 1000000000 + time_recv.tv_nsec);
+
+		stat_set(s->stats.time_rtt_us, ((int64_t) (time_recv.tv_sec - last_time_sent->tv_sec) * 1000000000 + time_recv.tv_nsec - last_time_sent->tv_nsec) / 1000);
+		stat_set(s->stats.time_offset_us, time_offset_at(&s->time_sync.published, (int64_t) time_recv.tv_sec * 1000000000 + time_recv.tv_nsec) / 1000);
+		stat_set(s->stats.time_freq_ppb, lrint(s->time_sync.published.freq * 1e9));
+
+		printverbose("Time packet received! sent = %ld.%09lu, serv = %ld.%09lu, recv = %ld.%09lu, diff = %+011"PRIi64", freq = %+.3f ppm\n", last_time_sent->tv_sec, last_time_sent->tv_nsec, time_serv.tv_sec, time_serv.tv_nsec, time_recv.tv_sec, time_recv.tv_nsec, time_offset_at(&s->time_sync.published, (int64_t) time_recv.tv_sec * 1000000000 + time_recv.tv_nsec), s->time_sync.published.freq * 1e6);
+	}
+}
+
+static void stream_receive(struct stream *s, int flags, uint64_t clock_period) {
+	// frames which were not handed over in the previous round (eg. time packets) are reused
+	unsigned int n = 0;
+	for (unsigned int i = 0; i < recv_batch; i++) {
+		if (s->recv_frames[i]) {
+			s->recv_frames[n++] = s->recv_frames[i];
+		}
+	}
+	while (n < recv_batch && (s->recv_frames[n] = spsc_pop(&s->free_queue))) {
+		n++;
+	}
+	memset(s->recv_frames + n, 0, (recv_batch - n) * sizeof(struct azz *));
+	int dropping = n == 0;
+
+	for (unsigned int i = 0; i < (dropping ? 1 : n); i++) {
+		recv_iovs[i].iov_base = &(dropping ? s->drop_frame : s->recv_frames[i])->packet;
+		recv_iovs[i].iov_len = sizeof(struct timep) + MAX_PAYLOAD_SIZE;
+		memset(&recv_msgs[i], 0, sizeof(struct mmsghdr));
+		recv_msgs[i].msg_hdr.msg_name = &recv_addrins[i];
+		recv_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+		recv_msgs[i].msg_hdr.msg_iov = &recv_iovs[i];
+		recv_msgs[i].msg_hdr.msg_iovlen = 1;
+		recv_msgs[i].msg_hdr.msg_control = recv_cmsgs + i * recv_cmsg_size;
+		recv_msgs[i].msg_hdr.msg_controllen = recv_cmsg_size;
+	}
+
+	errno = 0;
+	int count = recvmmsg(s->sock, recv_msgs, dropping ? 1 : n, flags, NULL);
+	if (count <= 0) {
+		if (errno == EINTR || errno == EAGAIN) {
+			return;
+		}
+		perror("recvmmsg");
+		exit(1);
+	}
+
+	for (unsigned int i = 0; i < count; i++) {
+		struct azz *currframe = dropping ? s->drop_frame : s->recv_frames[i];
+		struct sockaddr_in *addrin = &recv_addrins[i];
+		int plen = recv_msgs[i].msg_len;
+		int compact = packet_is_compact(&currframe->packet, plen);
+		if (plen <= (compact ? offsetof(struct hdrp, data) : sizeof(struct timep)) || recv_msgs[i].msg_hdr.msg_namelen != sizeof(struct sockaddr_in)) {
+			fprintf(stderr, "recvmmsg: invalid packet received (%d bytes)\n", plen);
+			exit(1);
+		}
+		if (recv_msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+			fprintf(stderr, "Received packet too big, dropping it\n");
+			stat_inc(s->stats.too_big);
+			continue;
+		}
+		currframe->datalen = plen;
+		stat_inc(s->stats.received);
+
+		// the kernel receive time is more accurate than anything we can measure here, but fall back to it if not available
+		struct timespec time_recv;
+		struct cmsghdr *cmsg;
+		for (cmsg = CMSG_FIRSTHDR(&recv_msgs[i].msg_hdr); cmsg; cmsg = CMSG_NXTHDR(&recv_msgs[i].msg_hdr, cmsg)) {
+			if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+				memcpy(&time_recv, CMSG_DATA(cmsg), sizeof(struct timespec));
+				break;
+			}
+		}
+		if (!cmsg) {
+			clock_gettime(CLOCK_REALTIME, &time_recv);
+		}
+
+		currframe->recv_time = (int64_t) time_recv.tv_sec * 1000000000 + time_recv.tv_nsec;
+		if (record_file) {
+			record_packet(&currframe->packet, plen, currframe->recv_time, time_offset_at(&s->time_sync.published, currframe->recv_time));
+		}
+		if (!packet_header_read(s, currframe, compact, compact ? time_offset_at(&s->time_sync.published, currframe->recv_time) : 0)) {
+			continue;
+		}
+
+		// time packets only come to the time socket, these were meant for another receiver (eg. from an older one)
+		if (!compact && currframe->datalen == sizeof(struct timep) && !(currframe->packet.tv_nsec & PARITY_FLAG)) {
+			continue;
+		} else if (enable_time_sync && s->last_time_sent.tv_sec != time_recv.tv_sec) {
+			struct timep_report timepacket;
+			clock_gettime(CLOCK_REALTIME, &s->last_time_sent);
+			timepacket.t.tv_sec = htobe64(s->last_time_sent.tv_sec);
+			timepacket.t.tv_nsec = htobe32(s->last_time_sent.tv_nsec);
+			size_t len = sizeof(struct timep);
+			if (report_fill(s, &timepacket.report)) {
+				len = sizeof(struct timep_report);
+			}
+			if (sendto(s->time_sock, &timepacket, len, 0, (struct sockaddr *) addrin, sizeof(struct sockaddr_in)) < 0) {
+				perror("sendto");
+			}
+		}
+
+		if (sim_loss_left || (sim_loss && rand_r(&sim_loss_seed) % (100 * sim_loss_burst) < sim_loss)) {
+			sim_loss_left = sim_loss_left ? sim_loss_left - 1 : sim_loss_burst - 1;
+			printverbose("Simulating loss of packet %"PRIi64".%09"PRIu32"\n", currframe->packet.tv_sec, currframe->packet.tv_nsec);
+			stat_inc(s->stats.simulated_loss);
+			continue;
+		}
+
+		if (!frame_prepare(s, currframe, clock_period)) {
+			continue;
+		}
+
+		if (dropping) {
+			fprintf(stderr, "Audio buffer full, dropping frame %"PRIi64".%09"PRIu32"\n", currframe->packet.tv_sec, currframe->packet.tv_nsec);
+			stat_inc(s->stats.dropped);
+			continue;
+		}
+
+		struct timespec time_queued;
+		clock_gettime(CLOCK_REALTIME, &time_queued);
+		histogram_add(&s->stats.receive_time, (int64_t) time_queued.tv_sec * 1000000000 + time_queued.tv_nsec - currframe->recv_time);
+		currframe->trace_time = monotonic_now();
+		unsigned int split = packet_split(s, currframe, split_frames, s->recv_frames + count, n - count, clock_period);
+		spsc_push(&s->recv_queue, currframe);
+		s->recv_frames[i] = NULL;
+		for (unsigned int j = 0; j < split; j++) {
+			spsc_push(&s->recv_queue, split_frames[j]);
+		}
+	}
+
+	if (record_file && fflush(record_file) != 0) {
+		fprintf(stderr, "Error while writing to %s: %s\n", record_path, strerror(errno));
+		exit(1);
+	}
+
+	// the replies are timestamped by the kernel, so it doesn't matter that they are only taken with the next packets
+	if (enable_time_sync) {
+		time_receive(s);
+	}
+}
+
 int main(int argc, char *argv[]) {
 	fprintf(stderr, "mrx - Receive audio via UDP unicast or multicast\n");
 	fprintf(stderr, "Copyright (C) 2014-2017 Vittorio Gambaletta <openwrt@vittgam.net>\n\n");
 
 	while (1) {
-		int c = getopt(argc, argv, "h:p:d:f:r:c:t:b:e:T:v:");
+		int c = getopt(argc, argv, "h:p:d:f:r:c:t:b:m:e:A:D:G:s:W:M:V:Y:n:L:J:O:U:w:R:S:T:v:");
 		if (c == -1) {
 			break;
 		} else if (c == 'h') {
@@ -206,32 +1545,87 @@ int main(int argc, char *argv[]) {
 		} else if (c == 'd') {
 			device = optarg;
 		} else if (c == 'f') {
-			use_float = strtoul(optarg, NULL, 10);
+			sample_format = strtoul(optarg, NULL, 10);
 		} else if (c == 'r') {
 			rate = strtoul(optarg, NULL, 10);
 		} else if (c == 'c') {
 			channels = strtoul(optarg, NULL, 10);
 		} else if (c == 't') {
-			audio_packet_duration = strtoul(optarg, NULL, 10);
+			audio_packet_duration = lrint(strtod(optarg, NULL) * 1000);
 		} else if (c == 'b') {
 			buffermult = strtoul(optarg, NULL, 10);
+		} else if (c == 'm') {
+			use_mmap = strtoul(optarg, NULL, 10);
 		} else if (c == 'e') {
 			delay = strtol(optarg, NULL, 10);
+		} else if (c == 'A') {
+			min_delay = strtol(optarg, NULL, 10);
+		} else if (c == 'D') {
+			drift_comp = strtoul(optarg, NULL, 10);
+		} else if (c == 'M') {
+			matrix_spec = optarg;
+		} else if (c == 'V') {
+			volume_cdb = lrint(strtod(optarg, NULL) * 100);
+		} else if (c == 'Y') {
+			volume_file = optarg;
+		} else if (c == 'G') {
+			gains = optarg;
+		} else if (c == 's') {
+			stream_ids = optarg;
+		} else if (c == 'W') {
+			decode_workers = strtoul(optarg, NULL, 10);
+		} else if (c == 'n') {
+			recv_batch = strtoul(optarg, NULL, 10);
+		} else if (c == 'L') {
+			char *endptr;
+			sim_loss = strtoul(optarg, &endptr, 10);
+			if (*endptr == ':') {
+				sim_loss_burst = strtoul(endptr + 1, NULL, 10);
+			}
+		} else if (c == 'J') {
+			sim_jitter = strtoul(optarg, NULL, 10);
+		} else if (c == 'O') {
+			sim_reorder = strtoul(optarg, NULL, 10);
+		} else if (c == 'U') {
+			sim_dup = strtoul(optarg, NULL, 10);
+		} else if (c == 'w') {
+			record_path = optarg;
+		} else if (c == 'R') {
+			replay_source = optarg;
+		} else if (c == 'S') {
+			stats_file = optarg;
 		} else if (c == 'T') {
 			enable_time_sync = strtoul(optarg, NULL, 10);
 		} else if (c == 'v') {
 			verbose = strtoul(optarg, NULL, 10);
 		} else {
 			fprintf(stderr, "\nUsage: mrx [<options>]\n\n");
-			fprintf(stderr, "    -h <addr>   IP address (default: %s)\n", addr);
+			fprintf(stderr, "    -h <addr>   IP address, or comma separated list of <addr>[:<port>] to mix several streams (default: %s)\n", addr);
 			fprintf(stderr, "    -p <port>   UDP port (default: %lu)\n", port);
 			fprintf(stderr, "    -d <dev>    ALSA device name, or '-' for stdin/stdout (default: '%s')\n", device);
-			fprintf(stderr, "    -f <n>      Use float samples (1) or signed 16 bit integer samples (0) (default: %lu)\n", use_float);
+			fprintf(stderr, "    -f <n>      Sample format: signed 16 bit (0), float (1), signed 24 bit packed in 3 bytes (2) or signed 32 bit (3) (default: %lu)\n", sample_format);
 			fprintf(stderr, "    -r <rate>   Audio sample rate (default: %lu Hz)\n", rate);
 			fprintf(stderr, "    -c <n>      Channels count (default: %lu)\n", channels);
-			fprintf(stderr, "    -t <ms>     Audio packet duration (default: %lu ms)\n", audio_packet_duration);
+			fprintf(stderr, "    -t <ms>     Audio packet duration, one of 2.5, 5, 10, 20, 40 or 60 (default: %g ms)\n", audio_packet_duration / 1000.0);
 			fprintf(stderr, "    -b <n>      ALSA buffer multiplier (default: %lu)\n", buffermult);
+			fprintf(stderr, "    -m <n>      Use ALSA mmap access when supported, to save a copy of each frame (default: %lu)\n", use_mmap);
 			fprintf(stderr, "    -e <ms>     Audio total delay (default: %ld ms)\n", delay);
+			fprintf(stderr, "    -A <ms>     Adapt the delay to the network jitter, down to this minimum total delay, 0 to disable (default: %ld ms)\n", min_delay);
+			fprintf(stderr, "    -D <n>      Compensate the ALSA device clock drift by resampling (default: %lu)\n", drift_comp);
+			fprintf(stderr, "    -G <dB>[,<dB>...] Gain of each stream, the last one applying to the following ones (default: 0 dB)\n");
+			fprintf(stderr, "    -s <id>[,<id>...] Stream id of each stream, for transmitters sending with the compact header to the same port, the last one applying to the following ones (default: 0)\n");
+			fprintf(stderr, "    -W <n>      Decode worker threads, besides the playback one, when mixing several streams (default: %lu)\n", decode_workers);
+			fprintf(stderr, "    -M <matrix> Output channels as rows of coefficients of the decoded ones, eg. '0.5,0.5' or '0,1;1,0', or 'mono'\n");
+			fprintf(stderr, "    -V <dB>     Output volume (default: %g dB)\n", volume_cdb / 100.0);
+			fprintf(stderr, "    -Y <file>   Read the output volume in dB from file every second, changing it smoothly\n");
+			fprintf(stderr, "    -n <n>      Max packets received per system call (default: %lu)\n", recv_batch);
+			fprintf(stderr, "    -L <pct>[:<n>] Simulate random packet loss in bursts of <n> packets, for testing (default: %lu%%:%lu)\n", sim_loss, sim_loss_burst);
+			fprintf(stderr, "    -J <ms>     Simulate random jitter of up to <ms>, when replaying (default: %lu ms)\n", sim_jitter);
+			fprintf(stderr, "    -O <pct>    Simulate reordering of packets, when replaying (default: %lu%%)\n", sim_reorder);
+			fprintf(stderr, "    -U <pct>    Simulate duplication of packets, when replaying (default: %lu%%)\n", sim_dup);
+			fprintf(stderr, "    -w <file>   Record received packets to file\n");
+			fprintf(stderr, "    -R <file>   Replay packets recorded with -w as fast as possible instead of receiving them, or 'synth[:<s>]' for a synthetic stream\n");
+			fprintf(stderr, "    -S <file>   Write statistics to file every second\n");
 			fprintf(stderr, "    -T <n>      Enable or disable time synchronization (default: %lu)\n", enable_time_sync);
 			fprintf(stderr, "    -v <n>      Be verbose (default: %lu)\n", verbose);
 			fprintf(stderr, "\n");
@@ -239,24 +1633,124 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
-	int sock = init_socket(1);
+	if (sample_format > SAMPLE_FORMAT_S32) {
+		fprintf(stderr, "Invalid sample format.\n");
+		exit(1);
+	}
+	use_float = sample_format != SAMPLE_FORMAT_S16;
 
-	set_realtime_prio();
+	struct sockaddr_in *addrs = NULL;
+	parse_destinations(addr, &addrs, &stream_count);
+	if (stream_count == 0) {
+		fprintf(stderr, "No addresses given\n");
+		exit(1);
+	}
+	if ((record_path || replay_source) && stream_count > 1) {
+		fprintf(stderr, "Recording and replaying only work with a single stream.\n");
+		exit(1);
+	}
+	if (recv_batch < 1) {
+		recv_batch = 1;
+	}
+	if (decode_workers > stream_count - 1) {
+		decode_workers = stream_count - 1;
+	}
 
-	pthread_barrier_init(&init_barrier, NULL, 2);
+	uint64_t clock_period = (uint64_t) 1000 * audio_packet_duration;
+	audio_buffer_size = (delay > 0 ? delay : 0) * 2000 / audio_packet_duration + 4;
+	if (recv_batch > audio_buffer_size) {
+		recv_batch = audio_buffer_size;
+	}
+	streams = calloc(stream_count, sizeof(struct stream));
+	if (!streams) {
+		fprintf(stderr, "Could not allocate %lu bytes of memory!\n", (unsigned long int) stream_count * sizeof(struct stream));
+		exit(1);
+	}
+	char *gain = gains, *id = stream_ids;
+	for (unsigned int i = 0; i < stream_count; i++) {
+		stream_init(&streams[i]);
+		streams[i].addr = addrs[i];
+		// gains are in dB, the last one given applies to all the following streams
+		if (gain && *gain) {
+			streams[i].gain = pow(10, strtod(gain, &gain) / 20);
+			gain += strspn(gain, ", ");
+		} else if (i > 0) {
+			streams[i].gain = streams[i - 1].gain;
+		}
+		if (id && *id) {
+			unsigned long int n = strtoul(id, &id, 10);
+			if (n > HEADER_MAX_STREAM) {
+				fprintf(stderr, "Stream ids go from 0 to %d.\n", HEADER_MAX_STREAM);
+				exit(1);
+			}
+			streams[i].id = n;
+			id += strspn(id, ", ");
+		} else if (i > 0) {
+			streams[i].id = streams[i - 1].id;
+		}
+	}
+	free(addrs);
+
+	if (matrix_spec || volume_file || volume_cdb) {
+		snd_pcm_uframes_t samples = (uint64_t) audio_packet_duration * rate / 1000000;
+		dsp_init(&dsp, matrix_spec, channels, samples + samples / 100 + 2, output_gain());
+		use_dsp = 1;
+	}
+
+	start_trace_thread(trace_dump);
+
+	if (replay_source) {
+		if (stats_file) {
+			start_stats_thread(stats_file, stats_dump);
+		}
+		replay(&streams[0], replay_source);
+		return 0;
+	}
+
+	for (unsigned int i = 0; i < stream_count; i++) {
+		streams[i].sock = init_socket(&streams[i].addr);
+		if (enable_time_sync) {
+			streams[i].time_sock = init_socket(NULL);
+			unsigned int one = 1;
+			if (setsockopt(streams[i].time_sock, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one)) < 0) {
+				perror("setsockopt(SO_TIMESTAMPNS)");
+			}
+		}
+	}
 
 	int ret;
 	pthread_t ths1;
 	pthread_attr_t thattr1;
 
-	pthread_mutex_init(&audio_mutex, NULL);
-	pthread_mutex_init(&time_mutex, NULL);
+	// started before getting realtime priority, which it doesn't need
+	if (volume_file) {
+		if ((ret = pthread_create(&ths1, NULL, volume_thread, NULL)) != 0) {
+			fprintf(stderr, "Error while calling pthread_create() for volume thread: error %d (%s)\n", ret, strerror(ret));
+			exit(1);
+		}
+		pthread_detach(ths1);
+	}
+
+	set_realtime_prio();
+
+	pthread_barrier_init(&init_barrier, NULL, 2);
+
 	pthread_attr_init(&thattr1);
 	pthread_attr_setdetachstate(&thattr1, PTHREAD_CREATE_DETACHED);
 	if ((ret = pthread_create(&ths1, &thattr1, audio_playback_thread, NULL)) != 0) {
 		fprintf(stderr, "Error while calling pthread_create() for audio playback thread: error %d (%s)\n", ret, strerror(ret));
 		exit(1);
 	}
+	if (decode_workers) {
+		pthread_barrier_init(&decode_start, NULL, decode_workers + 1);
+		pthread_barrier_init(&decode_done, NULL, decode_workers + 1);
+	}
+	for (uintptr_t i = 1; i <= decode_workers; i++) {
+		if ((ret = pthread_create(&ths1, &thattr1, decode_worker_thread, (void *) i)) != 0) {
+			fprintf(stderr, "Error while calling pthread_create() for decode worker thread: error %d (%s)\n", ret, strerror(ret));
+			exit(1);
+		}
+	}
 	pthread_attr_destroy(&thattr1);
 
 	pthread_barrier_wait(&init_barrier);
@@ -264,104 +1758,61 @@ int main(int argc, char *argv[]) {
 
 	drop_privs_if_needed();
 
-	struct timespec last_time_sent;
-	memset(&last_time_sent, 0, sizeof(last_time_sent));
-
-	while (1) {
-		struct sockaddr_in addrin;
-		unsigned int addrinlen = sizeof(addrin);
-		memset(&addrin, 0, sizeof(addrin));
+	if (stats_file) {
+		start_stats_thread(stats_file, stats_dump);
+	}
 
-		errno = 0;
-		int plen = recv(sock, NULL, 0, MSG_PEEK | MSG_TRUNC);
-		if (errno == EFAULT && ioctl(sock, FIONREAD, &plen)) {
-			perror("ioctl(FIONREAD)");
-			exit(1);
-		}
-		if (plen <= 0 || plen <= sizeof(struct timep)) {
-			perror("recv(PEEK)");
+	if (record_path) {
+		record_file = fopen(record_path, "w");
+		if (!record_file || fwrite(RECORD_MAGIC, sizeof(RECORD_MAGIC) - 1, 1, record_file) != 1) {
+			perror(record_path);
 			exit(1);
 		}
+	}
 
-		struct azz *currframe = malloc(offsetof(struct azz, packet) + plen);
-		if (!currframe) {
-			fprintf(stderr, "Could not allocate %lu bytes of memory!\n", (unsigned long int) offsetof(struct azz, packet) + plen);
-			exit(1);
+	recv_msgs = alloca(recv_batch * sizeof(struct mmsghdr));
+	recv_iovs = alloca(recv_batch * sizeof(struct iovec));
+	recv_addrins = alloca(recv_batch * sizeof(struct sockaddr_in));
+	recv_cmsg_size = CMSG_SPACE(sizeof(struct timespec));
+	recv_cmsgs = alloca(recv_batch * recv_cmsg_size);
+
+	sim_loss_seed = time(NULL);
+
+	// a single stream is received with blocking calls, which saves a system call for each batch
+	if (stream_count == 1) {
+		while (1) {
+			stream_receive(&streams[0], MSG_WAITFORONE, clock_period);
 		}
+	}
 
-		errno = 0;
-		currframe->datalen = recvfrom(sock, &currframe->packet, plen, 0, (struct sockaddr *) &addrin, &addrinlen);
-		if (currframe->datalen != plen || addrinlen != sizeof(addrin)) {
-			perror("recvfrom");
-			free(currframe);
+	int epfd = epoll_create1(0);
+	if (epfd < 0) {
+		perror("epoll_create1");
+		exit(1);
+	}
+	for (unsigned int i = 0; i < stream_count; i++) {
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.ptr = &streams[i];
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, streams[i].sock, &ev) < 0) {
+			perror("epoll_ctl");
 			exit(1);
 		}
+	}
+	struct epoll_event *events = alloca(stream_count * sizeof(struct epoll_event));
 
-		struct timespec time_recv;
-		clock_gettime(CLOCK_REALTIME, &time_recv);
-
-		currframe->datalen -= sizeof(struct timep);
-		currframe->packet.tv_sec = be64toh(currframe->packet.tv_sec);
-		currframe->packet.tv_nsec = be32toh(currframe->packet.tv_nsec);
-
-		if (currframe->datalen == sizeof(struct timep)) {
-			struct timep2 *timepacket = (struct timep2 *)&currframe->packet;
-			if (last_time_sent.tv_sec != 0 && timepacket->t1.tv_sec == last_time_sent.tv_sec && timepacket->t1.tv_nsec == last_time_sent.tv_nsec) {
-				struct timespec time_serv;
-				time_serv.tv_sec = be64toh(timepacket->t2.tv_sec);
-				time_serv.tv_nsec = be32toh(timepacket->t2.tv_nsec);
-
-				int64_t server_time_diff = (int64_t)time_serv.tv_sec - (((int64_t)last_time_sent.tv_sec + (int64_t)time_recv.tv_sec) / 2);
-				server_time_diff *= 1000000000;
-				server_time_diff += (int64_t)time_serv.tv_nsec - (((int64_t)last_time_sent.tv_nsec + (int64_t)time_recv.tv_nsec) / 2);
-
-				pthread_mutex_lock(&time_mutex);
-				server_time_diff_global = server_time_diff;
-				pthread_mutex_unlock(&time_mutex);
-
-				printverbose("Time packet received! sent = %ld.%09lu, serv = %ld.%09lu, recv = %ld.%09lu, diff = %+011"PRIi64"\n", last_time_sent.tv_sec, last_time_sent.tv_nsec, time_serv.tv_sec, time_serv.tv_nsec, time_recv.tv_sec, time_recv.tv_nsec, server_time_diff);
-			} else {
-				fprintf(stderr, "Invalid time packet received!\n");
-			}
-			continue;
-		} else if (enable_time_sync && last_time_sent.tv_sec != time_recv.tv_sec) {
-			struct timep timepacket;
-			clock_gettime(CLOCK_REALTIME, &last_time_sent);
-			timepacket.tv_sec = htobe64(last_time_sent.tv_sec);
-			timepacket.tv_nsec = htobe32(last_time_sent.tv_nsec);
-			if (sendto(sock, &timepacket, sizeof(struct timep), 0, (struct sockaddr *) &addrin, sizeof(addrin)) < 0) {
-				perror("sendto");
+	while (1) {
+		int count = epoll_wait(epfd, events, stream_count, -1);
+		if (count < 0) {
+			if (errno == EINTR) {
+				continue;
 			}
+			perror("epoll_wait");
+			exit(1);
 		}
-
-		pthread_mutex_lock(&audio_mutex);
-		if (audio_buffer && ((currframe->packet.tv_sec < audio_buffer->packet.tv_sec) || (currframe->packet.tv_sec == audio_buffer->packet.tv_sec && currframe->packet.tv_nsec < audio_buffer->packet.tv_nsec)) && ((currframe->packet.tv_sec <= last_packet_clock.tv_sec) || (currframe->packet.tv_sec == last_packet_clock.tv_sec && currframe->packet.tv_nsec <= last_packet_clock.tv_nsec))) {
-			fprintf(stderr, "Received frame %"PRIi64".%09"PRIu32" in the past (current = %"PRIi64".%09"PRIu32")\n", currframe->packet.tv_sec, currframe->packet.tv_nsec, audio_buffer->packet.tv_sec, audio_buffer->packet.tv_nsec);
-			free(currframe);
-		} else {
-			struct azz **audio_buffer_ptr = &audio_buffer;
-			unsigned int counter = delay < 150 ? 50 : (delay / 3);
-			while (--counter && *audio_buffer_ptr && (((*audio_buffer_ptr)->packet.tv_sec < currframe->packet.tv_sec) || ((*audio_buffer_ptr)->packet.tv_sec == currframe->packet.tv_sec && (*audio_buffer_ptr)->packet.tv_nsec < currframe->packet.tv_nsec))) {
-				audio_buffer_ptr = &(*audio_buffer_ptr)->next;
-			}
-			if (!counter) {
-				fprintf(stderr, "Received frame %"PRIi64".%09"PRIu32" too far in the future (current = %"PRIi64".%09"PRIu32")\n", currframe->packet.tv_sec, currframe->packet.tv_nsec, audio_buffer->packet.tv_sec, audio_buffer->packet.tv_nsec);
-				while (audio_buffer) {
-					struct azz *tmp = audio_buffer;
-					audio_buffer = audio_buffer->next;
-					free(tmp);
-				}
-				currframe->next = NULL;
-				audio_buffer = currframe;
-			} else if (*audio_buffer_ptr && (*audio_buffer_ptr)->packet.tv_sec == currframe->packet.tv_sec && (*audio_buffer_ptr)->packet.tv_nsec == currframe->packet.tv_nsec) {
-				fprintf(stderr, "Received duplicated frame %"PRIi64".%09"PRIu32"\n", currframe->packet.tv_sec, currframe->packet.tv_nsec);
-				free(currframe);
-			} else {
-				currframe->next = *audio_buffer_ptr;
-				*audio_buffer_ptr = currframe;
-			}
+		for (int i = 0; i < count; i++) {
+			stream_receive(events[i].data.ptr, MSG_DONTWAIT, clock_period);
 		}
-		pthread_mutex_unlock(&audio_mutex);
 	}
 
 	return 0;
@@ -16,6 +16,8 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -24,14 +26,30 @@
 #include <inttypes.h>
 #include <errno.h>
 #include <time.h>
+#include <signal.h>
+#include <math.h>
 #include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netinet/ip.h>
 #include <pwd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 #include <opus/opus.h>
 #include <alsa/asoundlib.h>
 
@@ -41,6 +59,40 @@ struct __attribute__((__packed__)) azzp {
 	unsigned char data;
 };
 
+// parity packets have this bit set in tv_nsec, which makes older receivers ignore them,
+// and the timestamp of the first frame of the block they protect in the rest of the header
+#define PARITY_FLAG 0x80000000
+
+struct __attribute__((__packed__)) parityp {
+	uint8_t count;
+	uint8_t depth;
+	uint8_t index;
+	uint8_t reserved;
+	uint32_t mask;
+	uint16_t datalen;
+	unsigned char data;
+};
+
+// the compact header that mtx -x 1 puts in front of audio and parity packets instead of the 12 bytes of azzp:
+// the magic and version byte, which legacy packets can't start with as it would be the top byte of their tv_sec,
+// the stream id, with HEADER_PARITY set for parity packets, so that several transmitters can share a port,
+// a sequence number counting every packet of the stream, and the timestamp of the frame in samples of the
+// transmitter clock, modulo 2^32, which receivers unwrap with their estimate of that clock
+#define HEADER_MAGIC 0xa0
+#define HEADER_VERSION 1
+#define HEADER_PARITY 0x80
+#define HEADER_MAX_STREAM 0x7f
+
+struct __attribute__((__packed__)) hdrp {
+	uint8_t magic;
+	uint8_t stream;
+	uint16_t seq;
+	uint32_t ts;
+	unsigned char data;
+};
+
+#define packet_is_compact(packet, len) ((len) >= offsetof(struct hdrp, data) && (*(uint8_t *) (packet) & 0xf0) == HEADER_MAGIC)
+
 struct __attribute__((__packed__)) timep {
 	int64_t tv_sec;
 	uint32_t tv_nsec;
@@ -50,8 +102,33 @@ struct __attribute__((__packed__)) timep2 {
 	struct timep t1, t2;
 };
 
+// mrx appends to its time requests what happened to the frames it played since the previous one, so that mtx can adapt
+// its bitrate and FEC to the receivers; lost counts the frames that were missing when played, recovered or not, late ones
+// included, and late the ones that arrived after that; transmitters that don't know about it just ignore the extra bytes
+struct __attribute__((__packed__)) reportp {
+	uint32_t frames, lost, late;
+};
+
+struct __attribute__((__packed__)) timep_report {
+	struct timep t;
+	struct reportp report;
+};
+
+// mrx -w records received datagrams for replaying them later with -R: the file starts with RECORD_MAGIC,
+// then each datagram follows its arrival time and the estimated transmitter clock offset at that time, big endian
+#define RECORD_MAGIC "mtrxrec1"
+
+struct __attribute__((__packed__)) recordp {
+	int64_t recv_time;
+	int64_t offset;
+	uint16_t len;
+};
+
 struct azz {
-	struct azz *next;
+	int64_t frame;
+	int64_t recv_time;
+	// CLOCK_MONOTONIC time the frame entered its current stage in mrx, for the latency traces
+	int64_t trace_time;
 	uint32_t datalen;
 	struct azzp packet;
 };
@@ -64,6 +141,75 @@ struct mapporc {
 	unsigned char pcm_data;
 };
 
+// the largest packet opus_encode may ever be asked to produce, as recommended by libopus
+#define MAX_PAYLOAD_SIZE 4000
+
+// wait-free single producer, single consumer queue of pointers
+struct spsc_queue {
+	unsigned int mask;
+	_Atomic unsigned int head, tail;
+	void **items;
+};
+
+// sequence lock for data written by one thread and read by others without blocking the writer
+struct seqlock {
+	_Atomic unsigned int seq;
+};
+
+// offset of the transmitter clock from the local one, as offset + freq * (local time - ref), plus a correction
+// slewed in at the rate slew from ref until slew_end
+struct time_offset {
+	int64_t ref;
+	int64_t offset;
+	double freq;
+	double slew;
+	int64_t slew_end;
+};
+
+#define TIME_SYNC_WINDOW 8
+
+// clock offset estimator fed with time sync round trips, published to readers through a seqlock
+struct time_sync {
+	struct seqlock lock;
+	struct time_offset published;
+	struct {
+		int64_t local, offset, rtt;
+	} samples[TIME_SYNC_WINDOW];
+	unsigned int count;
+	int64_t last_local;
+	double freq;
+};
+
+// power of two buckets of microseconds, the first one also counting negative times and the last one everything above it
+#define HISTOGRAM_BUCKETS 20
+
+struct histogram {
+	_Atomic unsigned long int buckets[HISTOGRAM_BUCKETS];
+};
+
+// statistics counters have a single writer each, so they don't need atomic read-modify-write operations
+#define stat_add(counter, n) atomic_store_explicit(&(counter), atomic_load_explicit(&(counter), memory_order_relaxed) + (n), memory_order_relaxed)
+#define stat_inc(counter) stat_add(counter, 1)
+#define stat_set(counter, n) atomic_store_explicit(&(counter), (n), memory_order_relaxed)
+#define stat_print(f, prefix, stats, name) fprintf(f, "%s%s %ld\n", prefix, #name, (long int) atomic_load_explicit(&(stats).name, memory_order_relaxed))
+
+// sample formats of the sound card, selected with -f; Opus gets float samples for all of them but S16
+#define SAMPLE_FORMAT_S16 0
+#define SAMPLE_FORMAT_FLOAT 1
+#define SAMPLE_FORMAT_S24_3LE 2
+#define SAMPLE_FORMAT_S32 3
+#define sample_format_converted(format) ((format) >= SAMPLE_FORMAT_S24_3LE)
+
+// the output stage of mrx, see dsp.c
+struct dsp {
+	unsigned int in_channels, out_channels;
+	// out_channels rows of in_channels coefficients, NULL to pass the channels through
+	float *matrix;
+	// the gain reached at the end of the last frame
+	float gain;
+	float *tmp, *tmp2;
+};
+
 #define printverbose(...) if (verbose) fprintf(stderr, __VA_ARGS__)
 
 #define snd_callcheck2(func, funcname, __snd_xx_retval, ...) \
@@ -91,15 +237,48 @@ struct mapporc {
 extern char *addr;
 extern unsigned long int port;
 extern char *device;
+extern unsigned long int sample_format;
 extern unsigned long int use_float;
 extern unsigned long int rate;
 extern unsigned long int channels;
+// in microseconds, so that the 2.5 ms frames of Opus can be used
 extern unsigned long int audio_packet_duration;
 extern unsigned long int buffermult;
+extern unsigned long int use_mmap;
 extern unsigned long int enable_time_sync;
 extern unsigned long int verbose;
 
+extern int64_t frame_number(int64_t tv_sec, uint32_t tv_nsec, uint64_t clock_period);
+extern void frame_timestamp(int64_t frame, uint64_t clock_period, struct timespec *ts);
+extern void spsc_init(struct spsc_queue *q, unsigned int size);
+extern int spsc_push(struct spsc_queue *q, void *item);
+extern void *spsc_pop(struct spsc_queue *q);
+extern void seqlock_write_begin(struct seqlock *sl);
+extern void seqlock_write_end(struct seqlock *sl);
+extern unsigned int seqlock_read_begin(struct seqlock *sl);
+extern int seqlock_read_retry(struct seqlock *sl, unsigned int seq);
+extern void time_sync_update(struct time_sync *ts, int64_t sent, int64_t serv, int64_t recv);
+extern void time_sync_read(struct time_sync *ts, struct time_offset *offset);
+extern int64_t time_offset_at(struct time_offset *offset, int64_t local);
+extern void histogram_add(struct histogram *h, int64_t nsecs);
+extern void histogram_print(FILE *f, const char *prefix, const char *name, struct histogram *h);
+extern void start_stats_thread(char *path, void (*dump)(FILE *f));
+extern int64_t monotonic_now();
+extern void start_trace_thread(void (*dump)(FILE *f));
 extern void set_realtime_prio();
 extern void drop_privs_if_needed();
-extern int init_socket(int is_mrx);
-extern snd_pcm_t *snd_my_init(char *device, int direction, unsigned long int rate, unsigned long int channels, unsigned long int use_float, snd_pcm_uframes_t *buffer, unsigned long int buffermult);
+extern int init_socket(struct sockaddr_in *group);
+extern void parse_destinations(char *list, struct sockaddr_in **dests, unsigned int *count);
+extern void parse_destinations_file(char *path, struct sockaddr_in **dests, unsigned int *count);
+extern snd_pcm_t *snd_my_init(char *device, int direction, unsigned long int rate, unsigned long int channels, unsigned long int format, snd_pcm_uframes_t *buffer, unsigned long int buffermult);
+extern void *snd_my_mmap_begin(snd_pcm_t *snd, snd_pcm_uframes_t frames, snd_pcm_uframes_t *offset, snd_pcm_sframes_t *ret);
+extern snd_pcm_sframes_t snd_my_readi(snd_pcm_t *snd, void *buffer, snd_pcm_uframes_t frames);
+extern snd_pcm_sframes_t snd_my_writei(snd_pcm_t *snd, const void *buffer, snd_pcm_uframes_t frames);
+extern unsigned long int pcm_simd;
+extern size_t pcm_sample_size(unsigned long int format);
+extern snd_pcm_format_t pcm_alsa_format(unsigned long int format);
+extern void pcm_to_float(float *out, const void *in, size_t n, unsigned long int format);
+extern void pcm_from_float(void *out, const float *in, size_t n, unsigned long int format);
+extern void dsp_init(struct dsp *d, char *spec, unsigned int in_channels, size_t max_frames, float gain);
+extern void dsp_destroy(struct dsp *d);
+extern void dsp_process(struct dsp *d, void *out, const void *in, size_t frames, float gain, int s16);
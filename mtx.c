@@ -19,80 +19,798 @@
 #include "mtrx.h"
 
 static unsigned long int kbps = 128;
+static unsigned long int low_delay = 0;
+static unsigned long int complexity = 9;
+static char *dests_file = NULL;
+static int addr_given = 0;
+static unsigned long int fec_loss_perc = 0;
+static unsigned long int min_kbps = 0;
+static unsigned long int receiver_percentile = 100;
+static unsigned long int parity_count = 0;
+static unsigned long int parity_depth = 1;
+static unsigned long int frames_per_packet = 1;
+static unsigned long int header_format = 0;
+static unsigned long int stream_id = 0;
+static size_t header_size = sizeof(struct timep);
+static unsigned long int capture_prio = 80, encode_prio = 60, send_prio = 70;
+static char *stats_file = NULL;
+
+struct profile_stats {
+	_Atomic long int sent, sent_bytes, send_errors, send_overruns, parity_sent, bundle_breaks, bitrate_kbps;
+	// the time each frame waited for its encoder thread, took to encode, and each packet took to be sent,
+	// from the end of the encoding until sendmmsg returned
+	struct histogram encode_queue, encode_time, send_time;
+};
+
+// every profile has its own encoder, bitrate, channel count and destinations, all of them fed by the same capture
+struct profile {
+	unsigned long int kbps, channels;
+	struct sockaddr_in *dests;
+	unsigned int dest_count;
+	// the same packet is sent to every destination with a single system call, by the sender thread
+	struct mmsghdr *msgs;
+	struct iovec iov;
+	// the frames captured for this profile, and the packets it hands over to the sender thread in slots that come back
+	// through send_free
+	struct spsc_queue encode_queue, send_queue, send_free;
+	uint8_t *send_slab;
+	OpusEncoder *encoder;
+	size_t bytes_per_frame;
+	struct azzp *packet;
+	void *pcm;
+	// with more than one frame per packet the frames are kept in bundle_data until the repacketizer puts them together,
+	// bundle_start being the timestamp of the first one and bundle_next the number of the one expected next
+	OpusRepacketizer *repacketizer;
+	unsigned char *bundle_data;
+	unsigned int bundled;
+	struct timespec bundle_start;
+	int64_t bundle_next;
+	// each block of parity_count * parity_depth frames is protected by parity_depth parity packets,
+	// the one with index j being the xor of frames j, j + parity_depth, j + 2 * parity_depth, ...
+	// so that a burst of up to parity_depth lost frames in a block can be recovered
+	struct azzp **parity_packets;
+	size_t *parity_lens;
+	int64_t parity_block;
+	// posted for every frame in encode_queue
+	sem_t start;
+	// the bitrate scale and FEC loss percentage currently set in the encoder
+	long int scale_permille, fec_perc;
+	// the compact header carries the stream id and a sequence number shared by audio and parity packets
+	uint8_t stream_id;
+	uint16_t seq;
+	struct profile_stats stats;
+};
+
+static struct profile *profiles = NULL;
+static unsigned int profile_count = 0;
+
+static struct {
+	// main thread
+	_Atomic long int captured, short_reads, capture_recoveries, missed_ticks, skipped_samples, encode_overruns;
+	// how long the first sample of each frame was in the ALSA buffer before being read
+	struct histogram capture_buffer;
+	// time sync thread
+	_Atomic long int time_requests, reports, receivers, worst_lost_permille, worst_late_permille, adapt_scale_permille, adapt_fec_perc;
+} stats;
+
+// the stages each frame goes through, in order
+static void trace_dump(FILE *f) {
+	histogram_print(f, "", "capture_buffer", &stats.capture_buffer);
+	for (unsigned int i = 0; i < profile_count; i++) {
+		struct profile_stats *st = &profiles[i].stats;
+		char prefix[32] = "";
+		if (profile_count > 1) {
+			snprintf(prefix, sizeof(prefix), "profile%u.", i);
+		}
+		histogram_print(f, prefix, "encode_queue", &st->encode_queue);
+		histogram_print(f, prefix, "encode_time", &st->encode_time);
+		histogram_print(f, prefix, "send_time", &st->send_time);
+	}
+}
+
+static void stats_dump(FILE *f) {
+	stat_print(f, "", stats, captured);
+	stat_print(f, "", stats, short_reads);
+	stat_print(f, "", stats, capture_recoveries);
+	stat_print(f, "", stats, missed_ticks);
+	stat_print(f, "", stats, skipped_samples);
+	stat_print(f, "", stats, encode_overruns);
+	stat_print(f, "", stats, time_requests);
+	stat_print(f, "", stats, reports);
+	stat_print(f, "", stats, receivers);
+	stat_print(f, "", stats, worst_lost_permille);
+	stat_print(f, "", stats, worst_late_permille);
+	stat_print(f, "", stats, adapt_scale_permille);
+	stat_print(f, "", stats, adapt_fec_perc);
+	// with more than one profile, the counters of each one are prefixed by its index, 0 being the one of -k and -h
+	for (unsigned int i = 0; i < profile_count; i++) {
+		struct profile_stats *st = &profiles[i].stats;
+		char prefix[32] = "";
+		if (profile_count > 1) {
+			snprintf(prefix, sizeof(prefix), "profile%u.", i);
+		}
+		stat_print(f, prefix, *st, sent);
+		stat_print(f, prefix, *st, sent_bytes);
+		stat_print(f, prefix, *st, send_errors);
+		stat_print(f, prefix, *st, send_overruns);
+		stat_print(f, prefix, *st, parity_sent);
+		stat_print(f, prefix, *st, bundle_breaks);
+		stat_print(f, prefix, *st, bitrate_kbps);
+	}
+	trace_dump(f);
+}
+
+// the capture thread never waits for the encoders: it hands the frames over through a ring of preallocated slots,
+// each encoder thread getting every one of them through the encode_queue of its profile, and a slot can only be
+// captured into again once all the encoders are done with it; if they fall that far behind, frames are dropped
+struct capture_slot {
+	struct timespec clock;
+	int64_t captured;
+	_Atomic unsigned int pending;
+	void *pcm;
+};
+
+static struct capture_slot *capture_slots = NULL;
+static unsigned int capture_slot_count = 0;
+
+// the encoders hand the packets over to the sender thread the same way, posting send_ready for each one
+struct send_slot {
+	size_t len;
+	int64_t queued;
+	unsigned char data[];
+};
+
+static sem_t send_ready;
+
+static void send_packet(struct profile *p, void *packet, size_t len) {
+	struct send_slot *slot = spsc_pop(&p->send_free);
+	if (!slot) {
+		printverbose("Sender thread behind, dropping packet\n");
+		stat_inc(p->stats.send_overruns);
+		return;
+	}
+	memcpy(slot->data, packet, len);
+	slot->len = len;
+	slot->queued = monotonic_now();
+	spsc_push(&p->send_queue, slot);
+	sem_post(&send_ready);
+}
+
+static void send_datagram(int sock, struct profile *p, void *packet, size_t len) {
+	p->iov.iov_base = packet;
+	p->iov.iov_len = len;
+	unsigned int sent = 0;
+	while (sent < p->dest_count) {
+		int ret = sendmmsg(sock, p->msgs + sent, p->dest_count - sent, 0);
+		if (ret < 0) {
+			// don't let a single unreachable destination stop the others
+			if (errno == EINTR) {
+				continue;
+			}
+			char addrstr[INET_ADDRSTRLEN];
+			inet_ntop(AF_INET, &p->dests[sent].sin_addr, addrstr, sizeof(addrstr));
+			fprintf(stderr, "sendmmsg to %s:%u: %s\n", addrstr, ntohs(p->dests[sent].sin_port), strerror(errno));
+			stat_inc(p->stats.send_errors);
+			ret = 1;
+		}
+		sent += ret;
+	}
+}
+
+// writes the header of a packet whose payload is already in place after the legacy header, returning where
+// the datagram starts, which is later with the shorter compact header
+static void *packet_header(struct profile *p, struct azzp *packet, struct timespec *ts, int parity) {
+	if (!header_format) {
+		packet->tv_sec = htobe64(ts->tv_sec);
+		packet->tv_nsec = htobe32(ts->tv_nsec | (parity ? PARITY_FLAG : 0));
+		return packet;
+	}
+	struct hdrp *hdr = (struct hdrp *) (&packet->data - offsetof(struct hdrp, data));
+	hdr->magic = HEADER_MAGIC | HEADER_VERSION;
+	hdr->stream = p->stream_id | (parity ? HEADER_PARITY : 0);
+	hdr->seq = htobe16(p->seq++);
+	// rounded up, so that receivers rounding down get back into the same frame
+	hdr->ts = htobe32((uint32_t) ts->tv_sec * rate + ((uint64_t) ts->tv_nsec * rate + 999999999) / 1000000000);
+	return hdr;
+}
+
+static void parity_flush(struct profile *p, uint64_t clock_period) {
+	struct timespec ts;
+	frame_timestamp(p->parity_block * parity_count * parity_depth, clock_period, &ts);
+	for (unsigned int j = 0; j < parity_depth; j++) {
+		struct azzp *packet = p->parity_packets[j];
+		struct parityp *parity = (struct parityp *) &packet->data;
+		if (!parity->mask) {
+			continue;
+		}
+		parity->mask = htobe32(parity->mask);
+		parity->datalen = htobe16(parity->datalen);
+		send_packet(p, packet_header(p, packet, &ts, 1), header_size + offsetof(struct parityp, data) + p->parity_lens[j]);
+		stat_inc(p->stats.parity_sent);
+		memset(&parity->data, 0, p->parity_lens[j]);
+		parity->mask = 0;
+		parity->datalen = 0;
+		p->parity_lens[j] = 0;
+	}
+}
+
+static void parity_add(struct profile *p, uint64_t clock_period, int64_t frame, unsigned char *data, size_t len) {
+	int64_t block_len = parity_count * parity_depth;
+	if (frame / block_len != p->parity_block) {
+		parity_flush(p, clock_period);
+		p->parity_block = frame / block_len;
+	}
+	unsigned int pos = frame % block_len;
+	struct parityp *parity = (struct parityp *) &p->parity_packets[pos % parity_depth]->data;
+	for (size_t i = 0; i < len; i++) {
+		(&parity->data)[i] ^= data[i];
+	}
+	parity->mask |= 1U << (pos / parity_depth);
+	parity->datalen ^= len;
+	if (len > p->parity_lens[pos % parity_depth]) {
+		p->parity_lens[pos % parity_depth] = len;
+	}
+	if (pos == block_len - 1) {
+		parity_flush(p, clock_period);
+	}
+}
+
+static void bundle_flush(struct profile *p) {
+	if (!p->bundled) {
+		return;
+	}
+	opus_int32 z = opus_repacketizer_out(p->repacketizer, &p->packet->data, frames_per_packet * p->bytes_per_frame + 2 * frames_per_packet);
+	if (z < 0) {
+		fprintf(stderr, "opus_repacketizer_out: %s\n", opus_strerror(z));
+		exit(1);
+	}
+	send_packet(p, packet_header(p, p->packet, &p->bundle_start, 0), z + header_size);
+	stat_inc(p->stats.sent);
+	stat_add(p->stats.sent_bytes, z + header_size);
+	opus_repacketizer_init(p->repacketizer);
+	p->bundled = 0;
+}
+
+// adds a frame, which is in bundle_data at the current position, to the packet being put together, which is sent when
+// the frame number gets to a multiple of frames_per_packet; a frame that can't follow the previous ones, because a tick
+// was missed or because the encoder changed mode or bandwidth, which Opus needs to be the same in all the frames of a
+// packet, sends them right away and starts another packet
+static void bundle_add(struct profile *p, struct timespec *clock, int64_t frame, unsigned char *data, size_t len) {
+	if (p->bundled && (frame != p->bundle_next || opus_repacketizer_cat(p->repacketizer, data, len) != OPUS_OK)) {
+		bundle_flush(p);
+		stat_inc(p->stats.bundle_breaks);
+		// the repacketizer keeps pointing to the frames, so this one goes to the first position for the next ones to follow
+		memmove(p->bundle_data, data, len);
+		data = p->bundle_data;
+	}
+	if (!p->bundled) {
+		if (opus_repacketizer_cat(p->repacketizer, data, len) != OPUS_OK) {
+			fprintf(stderr, "opus_repacketizer_cat: invalid packet from the encoder\n");
+			exit(1);
+		}
+		p->bundle_start = *clock;
+	}
+	p->bundled++;
+	p->bundle_next = frame + 1;
+	if (frame % frames_per_packet == frames_per_packet - 1) {
+		bundle_flush(p);
+	}
+}
+
+static void profile_set_quality(struct profile *p, long int scale_permille, long int fec_perc) {
+	long int bitrate = p->kbps * scale_permille;
+	bitrate = bitrate < 6000 ? 6000 : bitrate;
+	opus_encoder_ctl(p->encoder, OPUS_SET_BITRATE(bitrate));
+	stat_set(p->stats.bitrate_kbps, bitrate / 1000);
+	opus_encoder_ctl(p->encoder, OPUS_SET_INBAND_FEC(fec_perc > 0));
+	opus_encoder_ctl(p->encoder, OPUS_SET_PACKET_LOSS_PERC(fec_perc));
+	p->scale_permille = scale_permille;
+	p->fec_perc = fec_perc;
+}
+
+static void profile_init(struct profile *p, size_t samples) {
+	size_t pcm_size = samples * (use_float ? sizeof(float) : sizeof(int16_t)) * p->channels;
+	p->bytes_per_frame = p->kbps * audio_packet_duration / 8000;
+
+	int error;
+	// the restricted low delay mode only uses CELT, which saves the 4 ms of lookahead of the other ones but has no in-band FEC
+	p->encoder = opus_encoder_create(rate, p->channels, low_delay ? OPUS_APPLICATION_RESTRICTED_LOWDELAY : OPUS_APPLICATION_AUDIO, &error);
+	if (p->encoder == NULL) {
+		fprintf(stderr, "opus_encoder_create: %s\n", opus_strerror(error));
+		exit(1);
+	}
+	opus_encoder_ctl(p->encoder, OPUS_SET_COMPLEXITY(complexity > 10 ? 10 : complexity));
+	profile_set_quality(p, 1000, fec_loss_perc > 100 ? 100 : fec_loss_perc);
+
+	// a packet of several frames also has their lengths, up to two bytes each
+	size_t packet_size = sizeof(struct timep) + frames_per_packet * (p->bytes_per_frame + 2);
+	if (packet_size > sizeof(struct timep) + MAX_PAYLOAD_SIZE) {
+		fprintf(stderr, "Packets of %lu frames at %lu kbps would be too big for the receivers.\n", frames_per_packet, p->kbps);
+		exit(1);
+	}
+	p->packet = malloc(packet_size);
+	p->pcm = malloc(pcm_size);
+	p->msgs = calloc(p->dest_count, sizeof(struct mmsghdr));
+	if (!p->packet || !p->pcm || !p->msgs) {
+		fprintf(stderr, "Could not allocate %lu bytes of memory!\n", (unsigned long int) (packet_size + pcm_size + p->dest_count * sizeof(struct mmsghdr)));
+		exit(1);
+	}
+	if (frames_per_packet > 1) {
+		p->repacketizer = opus_repacketizer_create();
+		p->bundle_data = malloc(frames_per_packet * p->bytes_per_frame);
+		if (!p->repacketizer || !p->bundle_data) {
+			fprintf(stderr, "Could not allocate %lu bytes of memory!\n", (unsigned long int) (frames_per_packet * p->bytes_per_frame));
+			exit(1);
+		}
+	}
+	// room for the packets of a whole ring of frames, plus the parity packets sent at once at the end of a block
+	unsigned int send_slots = capture_slot_count + parity_depth + 1;
+	size_t send_slot_size = (offsetof(struct send_slot, data) + packet_size + offsetof(struct parityp, data) + 7) & ~(size_t) 7;
+	p->send_slab = malloc(send_slots * send_slot_size);
+	if (!p->send_slab) {
+		fprintf(stderr, "Could not allocate %lu bytes of memory!\n", (unsigned long int) (send_slots * send_slot_size));
+		exit(1);
+	}
+	spsc_init(&p->encode_queue, capture_slot_count);
+	spsc_init(&p->send_queue, send_slots);
+	spsc_init(&p->send_free, send_slots);
+	for (unsigned int i = 0; i < send_slots; i++) {
+		spsc_push(&p->send_free, p->send_slab + i * send_slot_size);
+	}
+	for (unsigned int i = 0; i < p->dest_count; i++) {
+		p->msgs[i].msg_hdr.msg_name = &p->dests[i];
+		p->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+		p->msgs[i].msg_hdr.msg_iov = &p->iov;
+		p->msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	p->parity_block = -1;
+	if (parity_count) {
+		p->parity_packets = calloc(parity_depth, sizeof(struct azzp *));
+		p->parity_lens = calloc(parity_depth, sizeof(size_t));
+		if (!p->parity_packets || !p->parity_lens) {
+			fprintf(stderr, "Could not allocate %lu bytes of memory!\n", (unsigned long int) parity_depth * (sizeof(struct azzp *) + sizeof(size_t)));
+			exit(1);
+		}
+		for (unsigned int j = 0; j < parity_depth; j++) {
+			p->parity_packets[j] = calloc(1, sizeof(struct timep) + offsetof(struct parityp, data) + p->bytes_per_frame);
+			if (!p->parity_packets[j]) {
+				fprintf(stderr, "Could not allocate %lu bytes of memory!\n", (unsigned long int) (sizeof(struct timep) + offsetof(struct parityp, data) + p->bytes_per_frame));
+				exit(1);
+			}
+			struct parityp *parity = (struct parityp *) &p->parity_packets[j]->data;
+			parity->count = parity_count;
+			parity->depth = parity_depth;
+			parity->index = j;
+		}
+	}
+}
+
+static void profile_destroy(struct profile *p) {
+	opus_encoder_destroy(p->encoder);
+	if (p->parity_packets) {
+		for (unsigned int j = 0; j < parity_depth; j++) {
+			free(p->parity_packets[j]);
+		}
+	}
+	free(p->parity_packets);
+	free(p->parity_lens);
+	if (p->repacketizer) {
+		opus_repacketizer_destroy(p->repacketizer);
+	}
+	free(p->bundle_data);
+	free(p->packet);
+	free(p->pcm);
+	free(p->msgs);
+	free(p->dests);
+	free(p->send_slab);
+	free(p->encode_queue.items);
+	free(p->send_queue.items);
+	free(p->send_free.items);
+}
+
+static void encode_and_send(struct profile *p, void *pcm, struct timespec clock) {
+	snd_pcm_uframes_t samples = (uint64_t) audio_packet_duration * rate / 1000000;
+	uint64_t clock_period = (uint64_t) 1000 * audio_packet_duration;
+
+	// a profile with fewer channels than the capture gets all of them mixed down to mono
+	if (p->channels != channels) {
+		for (snd_pcm_uframes_t i = 0; i < samples; i++) {
+			float sum = 0;
+			for (unsigned long int c = 0; c < channels; c++) {
+				sum += use_float ? ((float *) pcm)[i * channels + c] : ((int16_t *) pcm)[i * channels + c];
+			}
+			if (use_float) {
+				((float *) p->pcm)[i] = sum / channels;
+			} else {
+				((int16_t *) p->pcm)[i] = lrintf(sum / channels);
+			}
+		}
+		pcm = p->pcm;
+	}
+
+	// the encoder is only touched by the thread encoding for it, so the adaptation results are picked up here
+	if (min_kbps) {
+		long int scale_permille = atomic_load_explicit(&stats.adapt_scale_permille, memory_order_relaxed);
+		long int fec_perc = atomic_load_explicit(&stats.adapt_fec_perc, memory_order_relaxed);
+		if (scale_permille != p->scale_permille || fec_perc != p->fec_perc) {
+			printverbose("Setting %lu kbps profile to %ld%% bitrate and %ld%% FEC\n", p->kbps, scale_permille / 10, fec_perc);
+			profile_set_quality(p, scale_permille, fec_perc);
+		}
+	}
+
+	int64_t encode_start = monotonic_now();
+	unsigned char *data = frames_per_packet > 1 ? p->bundle_data + p->bundled * p->bytes_per_frame : &p->packet->data;
+	ssize_t z;
+	if (use_float) {
+		z = opus_encode_float(p->encoder, pcm, samples, data, p->bytes_per_frame);
+	} else {
+		z = opus_encode(p->encoder, pcm, samples, data, p->bytes_per_frame);
+	}
+	if (z < 0) {
+		fprintf(stderr, "opus_encode: %s\n", opus_strerror(z));
+		exit(1);
+	}
+
+	histogram_add(&p->stats.encode_time, monotonic_now() - encode_start);
+
+	int64_t frame = frame_number(clock.tv_sec, clock.tv_nsec, clock_period);
+	if (frames_per_packet > 1) {
+		// receivers get the frames out of the packet without the padding of constant bitrate, so the parity is computed
+		// on frames without it too
+		z = opus_packet_unpad(data, z);
+		bundle_add(p, &clock, frame, data, z);
+	} else {
+		send_packet(p, packet_header(p, p->packet, &clock, 0), z + header_size);
+		stat_inc(p->stats.sent);
+		stat_add(p->stats.sent_bytes, z + header_size);
+	}
+
+	if (parity_count) {
+		parity_add(p, clock_period, frame, data, z);
+	}
+}
+
+// every profile has its own encoder thread, so that they can use different cores
+static void *encoder_thread(void *arg) {
+	struct profile *p = arg;
+	printverbose("Encoder thread for %lu kbps started\n", p->kbps);
+	while (1) {
+		while (sem_wait(&p->start) != 0);
+		struct capture_slot *slot = spsc_pop(&p->encode_queue);
+		histogram_add(&p->stats.encode_queue, monotonic_now() - slot->captured);
+		encode_and_send(p, slot->pcm, slot->clock);
+		atomic_fetch_sub_explicit(&slot->pending, 1, memory_order_release);
+	}
+	pthread_exit(NULL);
+	return NULL;
+}
+
+// sends the packets of all the profiles, in the order each one encoded them, so that a send blocking for a while
+// delays neither the capture nor the encoding of the next frames
+static void *sender_thread(void *arg) {
+	int sock = *(int *) arg;
+	while (1) {
+		while (sem_wait(&send_ready) != 0);
+		for (unsigned int i = 0; i < profile_count; i++) {
+			struct send_slot *slot = spsc_pop(&profiles[i].send_queue);
+			if (slot) {
+				send_datagram(sock, &profiles[i], slot->data, slot->len);
+				histogram_add(&profiles[i].stats.send_time, monotonic_now() - slot->queued);
+				spsc_push(&profiles[i].send_free, slot);
+				break;
+			}
+		}
+	}
+	pthread_exit(NULL);
+	return NULL;
+}
+
+// starts a detached thread with the given realtime priority, or with normal scheduling for 0, falling back to
+// the scheduling of the calling thread if it is not allowed to
+static void thread_start(void *(*func)(void *), void *arg, unsigned long int prio, const char *name) {
+	int ret;
+	pthread_t th;
+	pthread_attr_t attr;
+	struct sched_param sp;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&attr, prio ? SCHED_FIFO : SCHED_OTHER);
+	sp.sched_priority = prio;
+	pthread_attr_setschedparam(&attr, &sp);
+	if ((ret = pthread_create(&th, &attr, func, arg)) == EPERM) {
+		fprintf(stderr, "Could not set the priority of the %s thread\n", name);
+		pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+		ret = pthread_create(&th, &attr, func, arg);
+	}
+	if (ret != 0) {
+		fprintf(stderr, "Error while calling pthread_create() for %s thread: error %d (%s)\n", name, ret, strerror(ret));
+		exit(1);
+	}
+	pthread_attr_destroy(&attr);
+}
+
+// the receivers that sent a report in the last few seconds, owned by the time sync thread
+struct receiver {
+	struct sockaddr_in addr;
+	time_t last_report;
+	double lost, late;
+};
+
+static struct receiver *receivers = NULL;
+static unsigned int receiver_count = 0;
+
+static void receiver_report(struct sockaddr_in *addr, struct reportp *report, time_t now) {
+	uint32_t frames = be32toh(report->frames);
+	if (frames == 0) {
+		return;
+	}
+	stat_inc(stats.reports);
+	struct receiver *r = NULL;
+	for (unsigned int i = 0; i < receiver_count; i++) {
+		if (receivers[i].addr.sin_addr.s_addr == addr->sin_addr.s_addr && receivers[i].addr.sin_port == addr->sin_port) {
+			r = &receivers[i];
+			break;
+		}
+	}
+	if (!r) {
+		struct receiver *receivers2 = realloc(receivers, (receiver_count + 1) * sizeof(struct receiver));
+		if (!receivers2) {
+			fprintf(stderr, "Could not allocate %lu bytes of memory!\n", (unsigned long int) (receiver_count + 1) * sizeof(struct receiver));
+			exit(1);
+		}
+		receivers = receivers2;
+		r = &receivers[receiver_count++];
+		r->addr = *addr;
+	}
+	r->last_report = now;
+	r->lost = (double) be32toh(report->lost) / frames;
+	r->late = (double) be32toh(report->late) / frames;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+	return *(const double *) a < *(const double *) b ? -1 : *(const double *) a > *(const double *) b;
+}
+
+// once per second the loss of the receiver at the given percentile (the worst one by default) drives the FEC loss
+// percentage, which goes up right away and down a point at a time, and the bitrate, which goes down by a fifth when
+// more than 5% of the frames are lost, and back up by a tenth after 10 seconds in a row with less than 1% lost
+static void adapt(time_t now) {
+	static unsigned int good_seconds = 0;
+	static long int scale_permille = 1000, fec_perc = -1;
+
+	for (unsigned int i = 0; i < receiver_count; i++) {
+		if (receivers[i].last_report < now - 5) {
+			receivers[i--] = receivers[--receiver_count];
+		}
+	}
+	stat_set(stats.receivers, receiver_count);
+	// without any report, or once all the receivers are gone, the nominal bitrate and FEC of -k and -F are used
+	if (receiver_count == 0 || fec_perc < 0) {
+		scale_permille = 1000;
+		fec_perc = fec_loss_perc > 100 ? 100 : fec_loss_perc;
+		good_seconds = 0;
+		stat_set(stats.adapt_scale_permille, scale_permille);
+		stat_set(stats.adapt_fec_perc, fec_perc);
+		if (receiver_count == 0) {
+			return;
+		}
+	}
+
+	double *lost = alloca(receiver_count * sizeof(double));
+	double late = 0;
+	for (unsigned int i = 0; i < receiver_count; i++) {
+		lost[i] = receivers[i].lost;
+		late = receivers[i].late > late ? receivers[i].late : late;
+	}
+	qsort(lost, receiver_count, sizeof(double), compare_doubles);
+	double loss = lost[(receiver_count * receiver_percentile + 99) / 100 - 1];
+	stat_set(stats.worst_lost_permille, lrint(lost[receiver_count - 1] * 1000));
+	stat_set(stats.worst_late_permille, lrint(late * 1000));
+
+	long int fec_target = ceil(loss * 100);
+	fec_target = fec_target < (long int) fec_loss_perc ? (long int) fec_loss_perc : fec_target > 50 ? 50 : fec_target;
+	if (fec_target > fec_perc) {
+		fec_perc = fec_target;
+	} else if (fec_target < fec_perc) {
+		fec_perc--;
+	}
+
+	long int min_scale = (min_kbps * 1000 + kbps - 1) / kbps;
+	if (loss > 0.05) {
+		scale_permille = scale_permille * 4 / 5;
+		good_seconds = 0;
+	} else if (loss < 0.01 && ++good_seconds >= 10) {
+		scale_permille = scale_permille * 11 / 10;
+		good_seconds = 0;
+	}
+	scale_permille = scale_permille < min_scale ? min_scale : scale_permille > 1000 ? 1000 : scale_permille;
+
+	printverbose("adapt: %u receivers, loss %.3f, late %.3f, bitrate %ld%%, FEC %ld%%\n", receiver_count, loss, late, scale_permille / 10, fec_perc);
+	stat_set(stats.adapt_scale_permille, scale_permille);
+	stat_set(stats.adapt_fec_perc, fec_perc);
+}
 
 static void *time_sync_thread(void *arg) {
 	printverbose("Time sync thread started\n");
 
 	int sock = *(int *)arg;
+	time_t last_adapt = 0;
+	// the adaptation also runs when no request comes in, so that receivers that went away are forgotten
+	if (min_kbps) {
+		struct timeval timeout = {1, 0};
+		if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
+			perror("setsockopt");
+		}
+	}
 
 	while (1) {
+		// a report, if any, is received where t2 goes in the answer
 		struct timep2 timepacket;
 		struct sockaddr_in addrin;
 		unsigned int addrinlen = sizeof(addrin);
 		memset(&addrin, 0, sizeof(addrin));
 
 		errno = 0;
-		int plen = recvfrom(sock, &timepacket, sizeof(struct timep), 0, (struct sockaddr *) &addrin, &addrinlen);
-		if (plen != sizeof(struct timep) || addrinlen != sizeof(addrin)) {
+		int plen = recvfrom(sock, &timepacket, sizeof(struct timep2), 0, (struct sockaddr *) &addrin, &addrinlen);
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		if (plen < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			if (now.tv_sec != last_adapt) {
+				last_adapt = now.tv_sec;
+				adapt(now.tv_sec);
+			}
+			continue;
+		}
+		if ((plen != sizeof(struct timep) && plen != sizeof(struct timep_report)) || addrinlen != sizeof(addrin)) {
 			perror("recvfrom");
 			continue;
 		}
 
-		struct timespec now;
-		clock_gettime(CLOCK_REALTIME, &now);
+		if (min_kbps) {
+			if (plen == sizeof(struct timep_report)) {
+				receiver_report(&addrin, (struct reportp *) &timepacket.t2, now.tv_sec);
+			}
+			if (now.tv_sec != last_adapt) {
+				last_adapt = now.tv_sec;
+				adapt(now.tv_sec);
+			}
+		}
 		timepacket.t2.tv_sec = htobe64(now.tv_sec);
 		timepacket.t2.tv_nsec = htobe32(now.tv_nsec);
 
 		if (sendto(sock, &timepacket, sizeof(struct timep2), 0, (struct sockaddr *) &addrin, sizeof(addrin)) < 0) {
 			perror("sendto");
 		}
+		stat_inc(stats.time_requests);
 	}
 
 	pthread_exit(NULL);
 	return NULL;
 }
 
+// spec is <kbps>[/<channels>]@<addr>[:<port>][,<addr>[:<port>]...]
+static void add_profile(char *spec) {
+	struct profile *profiles2 = realloc(profiles, (profile_count + 1) * sizeof(struct profile));
+	if (!profiles2) {
+		fprintf(stderr, "Could not allocate %lu bytes of memory!\n", (unsigned long int) (profile_count + 1) * sizeof(struct profile));
+		exit(1);
+	}
+	profiles = profiles2;
+	struct profile *p = &profiles[profile_count++];
+	memset(p, 0, sizeof(struct profile));
+
+	char *endptr;
+	p->kbps = strtoul(spec, &endptr, 10);
+	p->channels = channels;
+	if (*endptr == '/') {
+		p->channels = strtoul(endptr + 1, &endptr, 10);
+	}
+	if (*endptr != '@' || p->kbps == 0 || (p->channels != 1 && p->channels != channels)) {
+		fprintf(stderr, "Invalid profile '%s', it must be <kbps>[/<channels>]@<addr>[:<port>][,...] with either 1 or %lu channels\n", spec, channels);
+		exit(1);
+	}
+	parse_destinations(endptr + 1, &p->dests, &p->dest_count);
+}
+
 int main(int argc, char *argv[]) {
 	fprintf(stderr, "mtx - Transmit audio via UDP unicast or multicast\n");
 	fprintf(stderr, "Copyright (C) 2014-2017 Vittorio Gambaletta <openwrt@vittgam.net>\n\n");
 
+	char **profile_specs = alloca(argc * sizeof(char *));
+	unsigned int profile_spec_count = 0;
+
 	while (1) {
-		int c = getopt(argc, argv, "h:p:d:f:r:c:t:k:b:v:");
+		int c = getopt(argc, argv, "h:H:p:d:f:r:c:t:l:C:k:K:Q:E:F:P:I:N:x:s:R:b:m:S:v:");
 		if (c == -1) {
 			break;
 		} else if (c == 'h') {
 			addr = optarg;
+			addr_given = 1;
+		} else if (c == 'H') {
+			dests_file = optarg;
 		} else if (c == 'p') {
 			port = strtoul(optarg, NULL, 10);
 		} else if (c == 'd') {
 			device = optarg;
 		} else if (c == 'f') {
-			use_float = strtoul(optarg, NULL, 10);
+			sample_format = strtoul(optarg, NULL, 10);
 		} else if (c == 'r') {
 			rate = strtoul(optarg, NULL, 10);
 		} else if (c == 'c') {
 			channels = strtoul(optarg, NULL, 10);
 		} else if (c == 't') {
-			audio_packet_duration = strtoul(optarg, NULL, 10);
+			audio_packet_duration = lrint(strtod(optarg, NULL) * 1000);
+		} else if (c == 'l') {
+			low_delay = strtoul(optarg, NULL, 10);
+		} else if (c == 'C') {
+			complexity = strtoul(optarg, NULL, 10);
 		} else if (c == 'k') {
 			kbps = strtoul(optarg, NULL, 10);
+		} else if (c == 'K') {
+			min_kbps = strtoul(optarg, NULL, 10);
+		} else if (c == 'Q') {
+			receiver_percentile = strtoul(optarg, NULL, 10);
+		} else if (c == 'E') {
+			profile_specs[profile_spec_count++] = optarg;
+		} else if (c == 'F') {
+			fec_loss_perc = strtoul(optarg, NULL, 10);
+		} else if (c == 'P') {
+			parity_count = strtoul(optarg, NULL, 10);
+		} else if (c == 'I') {
+			parity_depth = strtoul(optarg, NULL, 10);
+		} else if (c == 'N') {
+			frames_per_packet = strtoul(optarg, NULL, 10);
+		} else if (c == 'x') {
+			header_format = strtoul(optarg, NULL, 10);
+		} else if (c == 's') {
+			stream_id = strtoul(optarg, NULL, 10);
+		} else if (c == 'R') {
+			char *end;
+			capture_prio = strtoul(optarg, &end, 10);
+			if (*end == ',') {
+				encode_prio = strtoul(end + 1, &end, 10);
+			}
+			if (*end == ',') {
+				send_prio = strtoul(end + 1, &end, 10);
+			}
 		} else if (c == 'b') {
 			buffermult = strtoul(optarg, NULL, 10);
+		} else if (c == 'm') {
+			use_mmap = strtoul(optarg, NULL, 10);
+		} else if (c == 'S') {
+			stats_file = optarg;
 		} else if (c == 'T') {
 			enable_time_sync = strtoul(optarg, NULL, 10);
 		} else if (c == 'v') {
 			verbose = strtoul(optarg, NULL, 10);
 		} else {
 			fprintf(stderr, "\nUsage: mtx [<options>]\n\n");
-			fprintf(stderr, "    -h <addr>   IP address (default: %s)\n", addr);
+			fprintf(stderr, "    -h <addr>   IP address, or comma separated list of <addr>[:<port>] (default: %s, unless -H is given)\n", addr);
+			fprintf(stderr, "    -H <file>   Send to the addresses listed in file, and to the -h ones only if given too\n");
 			fprintf(stderr, "    -p <port>   UDP port (default: %lu)\n", port);
 			fprintf(stderr, "    -d <dev>    ALSA device name, or '-' for stdin (default: '%s')\n", device);
-			fprintf(stderr, "    -f <n>      Use float samples (1) or signed 16 bit integer samples (0) (default: %lu)\n", use_float);
+			fprintf(stderr, "    -f <n>      Sample format: signed 16 bit (0), float (1), signed 24 bit packed in 3 bytes (2) or signed 32 bit (3) (default: %lu)\n", sample_format);
 			fprintf(stderr, "    -r <rate>   Audio sample rate (default: %lu Hz)\n", rate);
 			fprintf(stderr, "    -c <n>      Audio channel count (default: %lu)\n", channels);
-			fprintf(stderr, "    -t <ms>     Audio packet duration (default: %lu ms)\n", audio_packet_duration);
+			fprintf(stderr, "    -t <ms>     Audio packet duration, one of 2.5, 5, 10, 20, 40 or 60 (default: %g ms)\n", audio_packet_duration / 1000.0);
+			fprintf(stderr, "    -l <n>      Use the restricted low delay mode of Opus, without in-band FEC (default: %lu)\n", low_delay);
+			fprintf(stderr, "    -C <n>      Opus encoder complexity, 0 to 10 (default: %lu)\n", complexity);
 			fprintf(stderr, "    -k <kbps>   Network bitrate (default: %lu kbps)\n", kbps);
+			fprintf(stderr, "    -K <kbps>   Adapt bitrate and FEC to the loss reported by the receivers, down to this bitrate, 0 to disable (default: %lu kbps)\n", min_kbps);
+			fprintf(stderr, "    -Q <pct>    Percentile of the receivers to adapt to, 100 being the worst one (default: %lu%%)\n", receiver_percentile);
+			fprintf(stderr, "    -E <kbps>[/<channels>]@<addr>[:<port>][,...] Also encode the same audio at another bitrate, and optionally in mono, for other addresses; can be repeated\n");
+			fprintf(stderr, "    -F <pct>    Expected packet loss for Opus in-band FEC, 0 to disable (default: %lu%%)\n", fec_loss_perc);
+			fprintf(stderr, "    -P <n>      Send a parity packet every <n> frames, 0 to disable (default: %lu)\n", parity_count);
+			fprintf(stderr, "    -I <n>      Parity interleaving, to recover bursts of up to <n> lost frames (default: %lu)\n", parity_depth);
+			fprintf(stderr, "    -N <n>      Opus frames per packet, up to 120 ms of them, to send fewer packets (default: %lu)\n", frames_per_packet);
+			fprintf(stderr, "    -x <n>      Packet header: legacy (0) or compact, with stream id and sequence number (1) (default: %lu)\n", header_format);
+			fprintf(stderr, "    -s <id>     Stream id in the compact header, from 0 to %d, the one of each -E profile being the next one (default: %lu)\n", HEADER_MAX_STREAM, stream_id);
+			fprintf(stderr, "    -R <prio>[,<prio>[,<prio>]] Realtime priorities of the capture, encoder and sender threads, 0 for normal scheduling (default: %lu,%lu,%lu)\n", capture_prio, encode_prio, send_prio);
 			fprintf(stderr, "    -b <n>      ALSA buffer multiplier (default: %lu)\n", buffermult);
+			fprintf(stderr, "    -m <n>      Use ALSA mmap access when supported, to save a copy of each frame with -f 2 and 3 (default: %lu)\n", use_mmap);
+			fprintf(stderr, "    -S <file>   Write statistics to file every second\n");
 			fprintf(stderr, "    -T <n>      Enable or disable time synchronization (default: %lu)\n", enable_time_sync);
 			fprintf(stderr, "    -v <n>      Be verbose (default: %lu)\n", verbose);
 			fprintf(stderr, "\n");
@@ -100,9 +818,77 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
-	int sock = init_socket(0);
+	if (sample_format > SAMPLE_FORMAT_S32) {
+		fprintf(stderr, "Invalid sample format.\n");
+		exit(1);
+	}
+	use_float = sample_format != SAMPLE_FORMAT_S16;
 
-	set_realtime_prio();
+	if (min_kbps && (min_kbps > kbps || receiver_percentile < 1 || receiver_percentile > 100)) {
+		fprintf(stderr, "The minimum bitrate can't be higher than the bitrate, and the receiver percentile must be from 1 to 100.\n");
+		exit(1);
+	}
+
+	if (capture_prio > 99 || encode_prio > 99 || send_prio > 99) {
+		fprintf(stderr, "Realtime priorities go from 1 to 99.\n");
+		exit(1);
+	}
+
+	if (parity_count && (parity_count < 2 || parity_count > 32 || parity_depth < 1 || parity_depth > 255)) {
+		fprintf(stderr, "Parity packets can protect from 2 to 32 frames each, interleaved by 1 to 255.\n");
+		exit(1);
+	}
+
+	// the first profile is the one given by -k and -h
+	profiles = calloc(1, sizeof(struct profile));
+	if (!profiles) {
+		fprintf(stderr, "Could not allocate %lu bytes of memory!\n", (unsigned long int) sizeof(struct profile));
+		exit(1);
+	}
+	profile_count = 1;
+	profiles[0].kbps = kbps;
+	profiles[0].channels = channels;
+	// the default multicast group is only for when no destination is given at all
+	if (addr_given || !dests_file) {
+		parse_destinations(addr, &profiles[0].dests, &profiles[0].dest_count);
+	}
+	if (dests_file) {
+		parse_destinations_file(dests_file, &profiles[0].dests, &profiles[0].dest_count);
+	}
+	if (profiles[0].dest_count == 0) {
+		fprintf(stderr, "No destination addresses given\n");
+		exit(1);
+	}
+	for (unsigned int i = 0; i < profile_spec_count; i++) {
+		add_profile(profile_specs[i]);
+	}
+
+	if (frames_per_packet < 1 || frames_per_packet * audio_packet_duration > 120000) {
+		fprintf(stderr, "Packets can carry from 1 frame to 120 ms of audio.\n");
+		exit(1);
+	}
+
+	if (header_format > 1 || stream_id + profile_count - 1 > HEADER_MAX_STREAM) {
+		fprintf(stderr, "Invalid packet header format, or stream id over %d.\n", HEADER_MAX_STREAM);
+		exit(1);
+	}
+	if (header_format) {
+		header_size = offsetof(struct hdrp, data);
+	}
+	for (unsigned int i = 0; i < profile_count; i++) {
+		profiles[i].stream_id = stream_id + i;
+	}
+
+	start_trace_thread(trace_dump);
+
+	int sock = init_socket(NULL);
+
+	// the time sync thread gets the priority of the capture one
+	struct sched_param sp;
+	sp.sched_priority = capture_prio;
+	if (pthread_setschedparam(pthread_self(), capture_prio ? SCHED_FIFO : SCHED_OTHER, &sp) != 0) {
+		fprintf(stderr, "Could not set the priority of the capture thread\n");
+	}
 
 	if (enable_time_sync) {
 		int ret;
@@ -117,138 +903,241 @@ int main(int argc, char *argv[]) {
 		pthread_attr_destroy(&thattr1);
 	}
 
-	snd_pcm_uframes_t samples = audio_packet_duration * rate / 1000;
-	size_t pcm_size_multiplier = (use_float ? sizeof(float) : sizeof(int16_t)) * channels;
-	size_t pcm_size = samples * pcm_size_multiplier;
-	uint64_t clock_period = (uint64_t) 1000000 * audio_packet_duration;
-	size_t bytes_per_frame = kbps * audio_packet_duration / 8;
+	snd_pcm_uframes_t samples = (uint64_t) audio_packet_duration * rate / 1000000;
+	size_t pcm_size = samples * (use_float ? sizeof(float) : sizeof(int16_t)) * channels;
+	// the sound card or stdin might give wider integer samples, converted to float before encoding
+	int convert = sample_format_converted(sample_format);
+	size_t capture_size = samples * pcm_sample_size(sample_format) * channels;
+	uint64_t clock_period = (uint64_t) 1000 * audio_packet_duration;
 
-	int error;
-	OpusEncoder *encoder = opus_encoder_create(rate, channels, OPUS_APPLICATION_AUDIO, &error);
-	if (encoder == NULL) {
-		fprintf(stderr, "opus_encoder_create: %s\n", opus_strerror(error));
+	// the ring holds 100 ms of frames, which the encoders can lag behind by before frames are dropped
+	capture_slot_count = 100000 / audio_packet_duration;
+	capture_slot_count = capture_slot_count < 4 ? 4 : capture_slot_count;
+	capture_slots = calloc(capture_slot_count, sizeof(struct capture_slot));
+	void *scratch = malloc(pcm_size * (capture_slot_count + 1));
+	if (!capture_slots || !scratch) {
+		fprintf(stderr, "Could not allocate %lu bytes of memory!\n", (unsigned long int) (capture_slot_count * sizeof(struct capture_slot) + pcm_size * (capture_slot_count + 1)));
 		exit(1);
 	}
-	opus_encoder_ctl(encoder, OPUS_SET_BITRATE(kbps * 1000));
-	opus_encoder_ctl(encoder, OPUS_SET_COMPLEXITY(9));
+	for (unsigned int i = 0; i < capture_slot_count; i++) {
+		capture_slots[i].pcm = (uint8_t *) scratch + (i + 1) * pcm_size;
+	}
+
+	// the encoders pick up the adaptation results from the first frame, before any report came in
+	stat_set(stats.adapt_scale_permille, 1000);
+	stat_set(stats.adapt_fec_perc, fec_loss_perc > 100 ? 100 : fec_loss_perc);
+
+	sem_init(&send_ready, 0, 0);
+	for (unsigned int i = 0; i < profile_count; i++) {
+		profile_init(&profiles[i], samples);
+		sem_init(&profiles[i].start, 0, 0);
+		thread_start(encoder_thread, &profiles[i], encode_prio, "encoder");
+	}
+	thread_start(sender_thread, &sock, send_prio, "sender");
 
 	snd_pcm_t *snd = NULL;
 	snd_pcm_uframes_t buffer = samples;
 	if (strcmp(device, "-") != 0) {
-		snd = snd_my_init(device, SND_PCM_STREAM_CAPTURE, rate, channels, use_float, &buffer, buffermult);
+		snd = snd_my_init(device, SND_PCM_STREAM_CAPTURE, rate, channels, sample_format, &buffer, buffermult);
+	}
+
+	void *capture = convert ? alloca(capture_size) : NULL;
+	unsigned int capture_head = 0;
+	snd_pcm_uframes_t mmap_offset = 0, mmap_frames = 0;
+
+	// the capture runs in a loop driven by a timer on the frame boundaries of the network clock: at each tick the oldest
+	// captured frame is handed over to the encoders, or if none is ready yet, the ALSA descriptors are polled until it is
+	int tfd = timerfd_create(CLOCK_REALTIME, 0);
+	if (tfd < 0) {
+		perror("timerfd_create");
+		exit(1);
+	}
+	struct itimerspec timer;
+	clock_gettime(CLOCK_REALTIME, &timer.it_value);
+	timer.it_value.tv_nsec /= clock_period;
+	timer.it_value.tv_nsec *= clock_period;
+	timeadd(timer.it_value, clock_period);
+	timer.it_interval.tv_sec = 0;
+	timer.it_interval.tv_nsec = clock_period;
+	if (timerfd_settime(tfd, TFD_TIMER_ABSTIME, &timer, NULL) < 0) {
+		perror("timerfd_settime");
+		exit(1);
 	}
 
-	void *pcm = alloca(pcm_size);
-	struct azzp *packet = alloca(bytes_per_frame + sizeof(struct timep));
+	int snd_nfds = snd ? snd_pcm_poll_descriptors_count(snd) : 0;
+	struct pollfd *pfds = alloca((snd_nfds + 1) * sizeof(struct pollfd));
+	pfds[0].fd = tfd;
+	pfds[0].events = POLLIN;
+	if (snd) {
+		snd_pcm_nonblock(snd, 1);
+		snd_pcm_poll_descriptors(snd, pfds + 1, snd_nfds);
+	}
 
 	struct timespec clock = {0, 0};
-	int resync = 1;
+	// ticks whose frame has not been sent yet, the oldest of which is at clock
+	uint64_t due = 0, max_due = buffermult > 1 ? buffermult : 1;
 
 	drop_privs_if_needed();
 
+	if (stats_file) {
+		start_stats_thread(stats_file, stats_dump);
+	}
+
 	while (1) {
-		printverbose("clock %ld.%09lu\n", clock.tv_sec, clock.tv_nsec);
-
-		if (snd != NULL) {
-			// one of the many ways alsa-pulse is broken, is that audio sometimes glitches if snd_pcm_avail_delay is polled continuously...
-			if (resync) {
-				resync = 0;
-				snd_pcm_sframes_t availp, delayp;
-				snd_pcm_avail_delay(snd, &availp, &delayp);
-				printverbose("availp %ld %ld / %ld %ld\n", buffer, samples, availp, delayp);
-				// one of the many ways alsa-pulse is broken, is that capture buffer overrun is not properly detected and reported...
-				if (delayp < 0) {
-					resync = 1;
-				} else if (delayp > buffer) {
-					// one of the many ways alsa-pulse is broken, is that it does not implement snd_pcm_reset...
-					while (delayp > samples) {
-						printverbose("%d bad delayp %ld %ld, draining\n", snd_pcm_state(snd), availp, delayp);
-						snd_pcm_sframes_t delayp2 = (availp > samples && availp < delayp) ? availp : delayp;
-						if (delayp2 > 100000) {
-							delayp2 = 100000;
-						}
-						void *pcm2 = calloc(delayp2, pcm_size_multiplier);
-						if (!pcm2) {
-							fprintf(stderr, "Could not allocate %lu bytes of memory!\n", delayp2 * pcm_size_multiplier);
-							exit(1);
-						}
-						int ret = snd_pcm_readi(snd, pcm2, delayp2);
-						snd_pcm_avail_delay(snd, &availp, &delayp);
-						free(pcm2);
-						printverbose("drained %d of %ld, new %ld %ld\n", ret, delayp2, availp, delayp);
-						if (ret != delayp2) {
-							break;
-						}
-					}
-				}
-			}
+		if (snd && snd_pcm_state(snd) == SND_PCM_STATE_PREPARED) {
+			snd_pcm_start(snd);
+		}
 
-			int f = snd_pcm_readi(snd, pcm, samples);
-			if (f < 0) {
-				fprintf(stderr, "Recovering from error %d\n", f);
-				snd_callcheck2(snd_pcm_recover, "snd_pcm_readi", f, snd, f, 0);
+		// the ALSA descriptors are only watched while a frame is due, otherwise they would keep waking us up
+		int nfds = due ? snd_nfds + 1 : 1;
+		int ret = poll(pfds, nfds, -1);
+		if (ret < 0) {
+			if (errno == EINTR) {
 				continue;
-			} else if (f != samples) {
-				fprintf(stderr, "Short read, %d < %lu\n", f, samples);
-				continue;
-			}
-		} else {
-			int f = 0;
-			while (f < pcm_size) {
-				int f2 = read(0, (uint8_t *) pcm + f, pcm_size - f);
-				if (f2 <= 0) {
-					fprintf(stderr, "Error while reading audio from stdin, %d, %d %s\n", f2, errno, strerror(errno));
-					exit(1);
-				}
-				f += f2;
 			}
+			perror("poll");
+			exit(1);
 		}
 
-		ssize_t z;
-		if (use_float) {
-			z = opus_encode_float(encoder, pcm, samples, &packet->data, bytes_per_frame);
-		} else {
-			z = opus_encode(encoder, pcm, samples, &packet->data, bytes_per_frame);
+		if (pfds[0].revents & POLLIN) {
+			uint64_t expirations = 0;
+			if (read(tfd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+				perror("read(timerfd)");
+				exit(1);
+			}
+			// a late wakeup is caught up on by sending the frames of all the ticks that passed, as long as they are
+			// still in the capture buffer; older ones are lost (eg. after SIGSTOP/SIGCONT)
+			due += expirations;
+			if (due > max_due) {
+				printverbose("missed %"PRIu64" ticks\n", due - max_due);
+				if (clock.tv_sec) {
+					stat_add(stats.missed_ticks, due - max_due);
+				}
+				due = max_due;
+			}
+			clock_gettime(CLOCK_REALTIME, &clock);
+			clock.tv_nsec /= clock_period;
+			clock.tv_nsec *= clock_period;
+			timeadd(clock, -(int64_t) (due - 1) * (int64_t) clock_period);
+			printverbose("clock %ld.%09lu, %"PRIu64" due\n", clock.tv_sec, clock.tv_nsec, due);
 		}
-		if (z < 0) {
-			fprintf(stderr, "opus_encode: %s\n", opus_strerror(z));
-			exit(1);
+		if (nfds > 1 && ret > !!pfds[0].revents) {
+			unsigned short revents;
+			snd_pcm_poll_descriptors_revents(snd, pfds + 1, snd_nfds, &revents);
 		}
 
-		struct sockaddr_in addrin;
-		memset(&addrin, 0, sizeof(addrin));
-		addrin.sin_family = AF_INET;
-		addrin.sin_addr.s_addr = inet_addr(addr);
-		addrin.sin_port = htons((uint16_t) port);
+		while (due) {
+			// with the encoders a whole ring behind, the frame is still captured so that the device doesn't overrun,
+			// but into the scratch buffer
+			struct capture_slot *slot = &capture_slots[capture_head % capture_slot_count];
+			int overrun = atomic_load_explicit(&slot->pending, memory_order_acquire) != 0;
+			void *pcm = overrun ? scratch : slot->pcm;
+			void *in = convert ? capture : pcm;
+			if (snd != NULL) {
+				snd_pcm_sframes_t avail = snd_pcm_avail_update(snd);
+				if (avail >= 0 && avail < samples) {
+					break;
+				}
+				if (avail >= 0) {
+					snd_pcm_sframes_t queued = avail >= (snd_pcm_sframes_t) ((due + 2) * samples) ? (snd_pcm_sframes_t) ((due + 1) * samples) : avail;
+					histogram_add(&stats.capture_buffer, (int64_t) queued * 1000000000 / rate);
+				}
+				// more than two whole frames besides the due ones means that the capture got ahead of the network clock,
+				// so the oldest audio is skipped, in place if possible, keeping a frame of slack for the scheduling jitter
+				if (avail >= (snd_pcm_sframes_t) ((due + 2) * samples)) {
+					snd_pcm_sframes_t skip = avail - (due + 1) * samples;
+					snd_pcm_sframes_t skipped = snd_pcm_forward(snd, skip);
+					while (skipped >= 0 && skipped < skip) {
+						snd_pcm_sframes_t f = snd_my_readi(snd, in, skip - skipped < samples ? skip - skipped : samples);
+						if (f <= 0) {
+							break;
+						}
+						skipped += f;
+					}
+					printverbose("capture %ld frames ahead, skipped %ld\n", avail, skipped);
+					if (skipped > 0) {
+						stat_add(stats.skipped_samples, skipped);
+					}
+				}
 
-		struct timespec now;
-		clock_gettime(CLOCK_REALTIME, &now);
-		now.tv_nsec /= clock_period;
-		now.tv_nsec *= clock_period;
-		if (now.tv_sec < clock.tv_sec || (now.tv_sec == clock.tv_sec && now.tv_nsec <= clock.tv_nsec)) {
-			timeadd(now, clock_period);
-			while (clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &now, NULL) == EINTR);
-		}
-		// resync every 5 seconds or when there's a delay bigger than clock_period (eg. after SIGSTOP/SIGCONT)
-		if (clock.tv_sec && ((now.tv_sec % 5 == 0 && now.tv_nsec == 0) || ((((1000000000LL * (now.tv_sec - clock.tv_sec)) + (now.tv_nsec - clock.tv_nsec))) > clock_period))) {
-			resync = 1;
-		}
-		printverbose("resync %lld %d\n", (((1000000000LL * (now.tv_sec - clock.tv_sec)) + (now.tv_nsec - clock.tv_nsec))), resync);
-		clock = now;
+				int f;
+				snd_pcm_sframes_t err = avail < 0 ? avail : 0;
+				void *ring = use_mmap && avail >= 0 ? snd_my_mmap_begin(snd, samples, &mmap_offset, &err) : NULL;
+				if (ring) {
+					in = ring;
+					mmap_frames = samples;
+					f = samples;
+				} else {
+					f = err < 0 ? err : snd_my_readi(snd, in, samples);
+				}
+				if (f == -EAGAIN) {
+					break;
+				} else if (f < 0) {
+					fprintf(stderr, "Recovering from error %d\n", f);
+					stat_inc(stats.capture_recoveries);
+					snd_callcheck2(snd_pcm_recover, "snd_pcm_readi", f, snd, f, 0);
+					break;
+				} else if (f != samples) {
+					fprintf(stderr, "Short read, %d < %lu\n", f, samples);
+					stat_inc(stats.short_reads);
+					break;
+				}
+			} else {
+				int f = 0;
+				while (f < capture_size) {
+					int f2 = read(0, (uint8_t *) in + f, capture_size - f);
+					if (f2 <= 0) {
+						fprintf(stderr, "Error while reading audio from stdin, %d, %d %s\n", f2, errno, strerror(errno));
+						exit(1);
+					}
+					f += f2;
+				}
+			}
 
-		packet->tv_sec = htobe64(now.tv_sec);
-		packet->tv_nsec = htobe32(now.tv_nsec);
+			stat_inc(stats.captured);
 
-		if (sendto(sock, packet, z + sizeof(struct timep), 0, (struct sockaddr *) &addrin, sizeof(addrin)) < 0) {
-			perror("sendto");
-			exit(1);
+			// the frame is converted or copied out of the ring buffer of the device, which gets it back right away
+			if (convert) {
+				pcm_to_float(pcm, in, samples * channels, sample_format);
+			} else if (in != pcm) {
+				memcpy(pcm, in, pcm_size);
+			}
+			if (mmap_frames) {
+				snd_pcm_sframes_t ret = snd_pcm_mmap_commit(snd, mmap_offset, mmap_frames);
+				if (ret != mmap_frames) {
+					printverbose("mmap commit %ld of %lu\n", ret, mmap_frames);
+				}
+				mmap_frames = 0;
+			}
+
+			if (overrun) {
+				printverbose("Encoders behind, dropping frame %ld.%09lu\n", clock.tv_sec, clock.tv_nsec);
+				stat_inc(stats.encode_overruns);
+			} else {
+				slot->clock = clock;
+				slot->captured = monotonic_now();
+				atomic_store_explicit(&slot->pending, profile_count, memory_order_relaxed);
+				for (unsigned int i = 0; i < profile_count; i++) {
+					spsc_push(&profiles[i].encode_queue, slot);
+					sem_post(&profiles[i].start);
+				}
+				capture_head++;
+			}
+
+			due--;
+			timeadd(clock, clock_period);
 		}
 	}
 
 	if (snd && snd_pcm_close(snd) < 0)
 		abort();
 
-	opus_encoder_destroy(encoder);
+	for (unsigned int i = 0; i < profile_count; i++) {
+		profile_destroy(&profiles[i]);
+	}
+	free(profiles);
+	free(capture_slots);
+	free(scratch);
 
 	return 0;
 }
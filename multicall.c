@@ -21,21 +21,31 @@
 
 extern int mtx_main(int argc, char **argv);
 extern int mrx_main(int argc, char **argv);
+extern int relay_main(int argc, char **argv);
+extern int bench_main(int argc, char **argv);
 
 int main(int argc, char **argv) {
 	if (strstr(argv[0], "mtx")) {
 		return mtx_main(argc, argv);
 	} else if (strstr(argv[0], "mrx")) {
 		return mrx_main(argc, argv);
+	} else if (strstr(argv[0], "relay")) {
+		return relay_main(argc, argv);
+	} else if (strstr(argv[0], "bench")) {
+		return bench_main(argc, argv);
 	} else if (argc > 1) {
 		if (strstr(argv[1], "mtx")) {
 			return mtx_main(argc - 1, argv + 1);
 		} else if (strstr(argv[1], "mrx")) {
 			return mrx_main(argc - 1, argv + 1);
+		} else if (strstr(argv[1], "relay")) {
+			return relay_main(argc - 1, argv + 1);
+		} else if (strstr(argv[1], "bench")) {
+			return bench_main(argc - 1, argv + 1);
 		}
 	}
 	fprintf(stderr, "mtrx - Transmit and receive audio via UDP unicast or multicast\n");
 	fprintf(stderr, "Copyright (C) 2014-2017 Vittorio Gambaletta <openwrt@vittgam.net>\n\n");
-	fprintf(stderr, "Invalid command.\n\nUsage: %s mtx|mrx [<options>]\n\n", argv[0]);
+	fprintf(stderr, "Invalid command.\n\nUsage: %s mtx|mrx|relay|bench [<options>]\n\n", argv[0]);
 	return 127;
 }
@@ -0,0 +1,320 @@
+/*
+ * mtrx - Transmit and receive audio via UDP unicast or multicast
+ * Copyright (C) 2014-2017 Vittorio Gambaletta <openwrt@vittgam.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mtrx.h"
+
+// the wider integer formats are converted from and to the float samples Opus works with here, instead of going through
+// the plug layer of ALSA; both are handled as 32 bit integers scaled by 2^31, the packed 24 bit ones being shifted up
+// by a byte, so that the conversions are a single multiplication; the SIMD kernels do the bulk of each frame and leave
+// the last few samples to the plain C ones, and can be disabled to compare them (mtrx bench conv)
+unsigned long int pcm_simd = 1;
+
+#define S32_SCALE (1.0f / 2147483648.0f)
+// the largest float below 2^31, since 2^31 itself doesn't fit in an int32_t
+#define S32_MAX_FLOAT 2147483520.0f
+#define S24_MAX_FLOAT 8388607.0f
+
+size_t pcm_sample_size(unsigned long int format) {
+	switch (format) {
+	case SAMPLE_FORMAT_S16:
+		return sizeof(int16_t);
+	case SAMPLE_FORMAT_S24_3LE:
+		return 3;
+	default:
+		return sizeof(int32_t);
+	}
+}
+
+snd_pcm_format_t pcm_alsa_format(unsigned long int format) {
+	switch (format) {
+	case SAMPLE_FORMAT_S16:
+		return SND_PCM_FORMAT_S16;
+	case SAMPLE_FORMAT_FLOAT:
+		return SND_PCM_FORMAT_FLOAT;
+	case SAMPLE_FORMAT_S24_3LE:
+		return SND_PCM_FORMAT_S24_3LE;
+	default:
+		return SND_PCM_FORMAT_S32;
+	}
+}
+
+static void s32_to_float(float *out, const int32_t *in, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		out[i] = in[i] * S32_SCALE;
+	}
+}
+
+static void float_to_s32(int32_t *out, const float *in, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		float x = in[i] * 2147483648.0f;
+		out[i] = lrintf(x > S32_MAX_FLOAT ? S32_MAX_FLOAT : x < -2147483648.0f ? -2147483648.0f : x);
+	}
+}
+
+static void s24_3le_to_float(float *out, const uint8_t *in, size_t n) {
+	for (size_t i = 0; i < n; i++, in += 3) {
+		out[i] = (int32_t) ((uint32_t) in[0] << 8 | (uint32_t) in[1] << 16 | (uint32_t) in[2] << 24) * S32_SCALE;
+	}
+}
+
+static void float_to_s24_3le(uint8_t *out, const float *in, size_t n) {
+	for (size_t i = 0; i < n; i++, out += 3) {
+		float x = in[i] * 8388608.0f;
+		int32_t v = lrintf(x > S24_MAX_FLOAT ? S24_MAX_FLOAT : x < -8388608.0f ? -8388608.0f : x);
+		out[0] = v;
+		out[1] = v >> 8;
+		out[2] = v >> 16;
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// each kernel converts as many samples as it can and returns how many, the caller finishing the rest
+
+__attribute__((target("sse2")))
+static size_t s32_to_float_sse2(float *out, const int32_t *in, size_t n) {
+	size_t i = 0;
+	__m128 scale = _mm_set1_ps(S32_SCALE);
+	for (; i + 4 <= n; i += 4) {
+		_mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *) (in + i))), scale));
+	}
+	return i;
+}
+
+// cvtps2dq gives INT32_MIN for anything out of range, which is right for the negative side only
+__attribute__((target("sse2")))
+static size_t float_to_s32_sse2(int32_t *out, const float *in, size_t n) {
+	size_t i = 0;
+	__m128 scale = _mm_set1_ps(2147483648.0f), max = _mm_set1_ps(S32_MAX_FLOAT);
+	for (; i + 4 <= n; i += 4) {
+		__m128 x = _mm_min_ps(_mm_mul_ps(_mm_loadu_ps(in + i), scale), max);
+		_mm_storeu_si128((__m128i *) (out + i), _mm_cvtps_epi32(x));
+	}
+	return i;
+}
+
+__attribute__((target("avx2")))
+static size_t s32_to_float_avx2(float *out, const int32_t *in, size_t n) {
+	size_t i = 0;
+	__m256 scale = _mm256_set1_ps(S32_SCALE);
+	for (; i + 8 <= n; i += 8) {
+		_mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i *) (in + i))), scale));
+	}
+	return i;
+}
+
+__attribute__((target("avx2")))
+static size_t float_to_s32_avx2(int32_t *out, const float *in, size_t n) {
+	size_t i = 0;
+	__m256 scale = _mm256_set1_ps(2147483648.0f), max = _mm256_set1_ps(S32_MAX_FLOAT);
+	for (; i + 8 <= n; i += 8) {
+		__m256 x = _mm256_min_ps(_mm256_mul_ps(_mm256_loadu_ps(in + i), scale), max);
+		_mm256_storeu_si256((__m256i *) (out + i), _mm256_cvtps_epi32(x));
+	}
+	return i;
+}
+
+// packed 24 bit samples are spread into the upper three bytes of each 32 bit lane with a byte shuffle; the loads
+// are 16 bytes wide for 12 bytes of samples, so they stop while at least 4 more bytes are there to be read
+__attribute__((target("ssse3")))
+static size_t s24_3le_to_float_ssse3(float *out, const uint8_t *in, size_t n) {
+	size_t i = 0;
+	__m128 scale = _mm_set1_ps(S32_SCALE);
+	__m128i shuffle = _mm_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+	for (; i + 6 <= n; i += 4) {
+		__m128i v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (in + i * 3)), shuffle);
+		_mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(v), scale));
+	}
+	return i;
+}
+
+__attribute__((target("ssse3")))
+static size_t float_to_s24_3le_ssse3(uint8_t *out, const float *in, size_t n) {
+	size_t i = 0;
+	__m128 scale = _mm_set1_ps(8388608.0f), min = _mm_set1_ps(-8388608.0f), max = _mm_set1_ps(S24_MAX_FLOAT);
+	__m128i shuffle = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+	for (; i + 4 <= n; i += 4) {
+		__m128 x = _mm_max_ps(_mm_min_ps(_mm_mul_ps(_mm_loadu_ps(in + i), scale), max), min);
+		__m128i v = _mm_shuffle_epi8(_mm_cvtps_epi32(x), shuffle);
+		_mm_storel_epi64((__m128i *) (out + i * 3), v);
+		uint32_t last = _mm_cvtsi128_si32(_mm_srli_si128(v, 8));
+		memcpy(out + i * 3 + 8, &last, sizeof(last));
+	}
+	return i;
+}
+
+// the same shuffle in both 128 bit lanes, each loaded from its own 12 bytes
+__attribute__((target("avx2")))
+static size_t s24_3le_to_float_avx2(float *out, const uint8_t *in, size_t n) {
+	size_t i = 0;
+	__m256 scale = _mm256_set1_ps(S32_SCALE);
+	__m256i shuffle = _mm256_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+	for (; i + 10 <= n; i += 8) {
+		__m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) (in + i * 3))), _mm_loadu_si128((const __m128i *) (in + i * 3 + 12)), 1);
+		_mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_shuffle_epi8(v, shuffle)), scale));
+	}
+	return i;
+}
+
+static int cpu_supports_sse2, cpu_supports_ssse3, cpu_supports_avx2;
+
+__attribute__((constructor))
+static void pcm_cpu_init() {
+	__builtin_cpu_init();
+	cpu_supports_sse2 = __builtin_cpu_supports("sse2");
+	cpu_supports_ssse3 = __builtin_cpu_supports("ssse3");
+	cpu_supports_avx2 = __builtin_cpu_supports("avx2");
+}
+
+static size_t s32_to_float_simd(float *out, const int32_t *in, size_t n) {
+	return cpu_supports_avx2 ? s32_to_float_avx2(out, in, n) : cpu_supports_sse2 ? s32_to_float_sse2(out, in, n) : 0;
+}
+
+static size_t float_to_s32_simd(int32_t *out, const float *in, size_t n) {
+	return cpu_supports_avx2 ? float_to_s32_avx2(out, in, n) : cpu_supports_sse2 ? float_to_s32_sse2(out, in, n) : 0;
+}
+
+static size_t s24_3le_to_float_simd(float *out, const uint8_t *in, size_t n) {
+	return cpu_supports_avx2 ? s24_3le_to_float_avx2(out, in, n) : cpu_supports_ssse3 ? s24_3le_to_float_ssse3(out, in, n) : 0;
+}
+
+static size_t float_to_s24_3le_simd(uint8_t *out, const float *in, size_t n) {
+	return cpu_supports_ssse3 ? float_to_s24_3le_ssse3(out, in, n) : 0;
+}
+
+#elif defined(__ARM_NEON)
+
+// the fixed point conversions of NEON do the scaling by 2^31 and saturate by themselves; the ones back to integers
+// round toward zero on 32 bit ARM, which is off by less than one step of the 24 bit output at most
+static size_t s32_to_float_simd(float *out, const int32_t *in, size_t n) {
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		vst1q_f32(out + i, vcvtq_n_f32_s32(vld1q_s32(in + i), 31));
+	}
+	return i;
+}
+
+static int32x4_t float_to_s32_neon(float32x4_t x) {
+#ifdef __aarch64__
+	return vcvtnq_s32_f32(vmulq_n_f32(x, 2147483648.0f));
+#else
+	return vcvtq_n_s32_f32(x, 31);
+#endif
+}
+
+static size_t float_to_s32_simd(int32_t *out, const float *in, size_t n) {
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		vst1q_s32(out + i, float_to_s32_neon(vld1q_f32(in + i)));
+	}
+	return i;
+}
+
+// the three bytes of 16 samples are loaded into one register each, and interleaved with zeroes into 32 bit lanes
+static size_t s24_3le_to_float_simd(float *out, const uint8_t *in, size_t n) {
+	size_t i = 0;
+	uint8x16_t zero = vdupq_n_u8(0);
+	for (; i + 16 <= n; i += 16) {
+		uint8x16x3_t b = vld3q_u8(in + i * 3);
+		uint8x16x2_t lo = vzipq_u8(zero, b.val[0]), hi = vzipq_u8(b.val[1], b.val[2]);
+		for (int j = 0; j < 2; j++) {
+			uint16x8x2_t w = vzipq_u16(vreinterpretq_u16_u8(lo.val[j]), vreinterpretq_u16_u8(hi.val[j]));
+			vst1q_f32(out + i + j * 8, vcvtq_n_f32_s32(vreinterpretq_s32_u16(w.val[0]), 31));
+			vst1q_f32(out + i + j * 8 + 4, vcvtq_n_f32_s32(vreinterpretq_s32_u16(w.val[1]), 31));
+		}
+	}
+	return i;
+}
+
+static int32x4_t float_to_s24_neon(float32x4_t x) {
+#ifdef __aarch64__
+	return vcvtnq_s32_f32(vmulq_n_f32(x, 8388608.0f));
+#else
+	return vcvtq_n_s32_f32(x, 23);
+#endif
+}
+
+// and the other way around, the samples are shifted up into the upper three bytes of 32 bit lanes, whose bytes
+// are then split into one register each, the lowest one being left out
+static size_t float_to_s24_3le_simd(uint8_t *out, const float *in, size_t n) {
+	size_t i = 0;
+	float32x4_t min = vdupq_n_f32(-1.0f), max = vdupq_n_f32(S24_MAX_FLOAT / 8388608.0f);
+	for (; i + 16 <= n; i += 16) {
+		uint8x16_t v[4];
+		for (int j = 0; j < 4; j++) {
+			float32x4_t x = vmaxq_f32(vminq_f32(vld1q_f32(in + i + j * 4), max), min);
+			v[j] = vreinterpretq_u8_s32(vshlq_n_s32(float_to_s24_neon(x), 8));
+		}
+		uint8x16x2_t a = vuzpq_u8(v[0], v[1]), b = vuzpq_u8(v[2], v[3]);
+		uint8x16x2_t even = vuzpq_u8(a.val[0], b.val[0]), odd = vuzpq_u8(a.val[1], b.val[1]);
+		uint8x16x3_t bytes = {{odd.val[0], even.val[1], odd.val[1]}};
+		vst3q_u8(out + i * 3, bytes);
+	}
+	return i;
+}
+
+#else
+
+static size_t s32_to_float_simd(float *out, const int32_t *in, size_t n) {
+	return 0;
+}
+
+static size_t float_to_s32_simd(int32_t *out, const float *in, size_t n) {
+	return 0;
+}
+
+static size_t s24_3le_to_float_simd(float *out, const uint8_t *in, size_t n) {
+	return 0;
+}
+
+static size_t float_to_s24_3le_simd(uint8_t *out, const float *in, size_t n) {
+	return 0;
+}
+
+#endif
+
+// n is the number of samples of all channels
+void pcm_to_float(float *out, const void *in, size_t n, unsigned long int format) {
+	size_t i = 0;
+	if (format == SAMPLE_FORMAT_S24_3LE) {
+		if (pcm_simd) {
+			i = s24_3le_to_float_simd(out, in, n);
+		}
+		s24_3le_to_float(out + i, (const uint8_t *) in + i * 3, n - i);
+	} else {
+		if (pcm_simd) {
+			i = s32_to_float_simd(out, in, n);
+		}
+		s32_to_float(out + i, (const int32_t *) in + i, n - i);
+	}
+}
+
+void pcm_from_float(void *out, const float *in, size_t n, unsigned long int format) {
+	size_t i = 0;
+	if (format == SAMPLE_FORMAT_S24_3LE) {
+		if (pcm_simd) {
+			i = float_to_s24_3le_simd(out, in, n);
+		}
+		float_to_s24_3le((uint8_t *) out + i * 3, in + i, n - i);
+	} else {
+		if (pcm_simd) {
+			i = float_to_s32_simd(out, in, n);
+		}
+		float_to_s32((int32_t *) out + i, in + i, n - i);
+	}
+}
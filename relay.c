@@ -0,0 +1,321 @@
+/*
+ * mtrx - Transmit and receive audio via UDP unicast or multicast
+ * Copyright (C) 2014-2017 Vittorio Gambaletta <openwrt@vittgam.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mtrx.h"
+
+static char *dests_list = NULL;
+static char *dests_file = NULL;
+static unsigned long int recv_batch = 16;
+static char *stats_file = NULL;
+
+static struct sockaddr_in *dests = NULL;
+static unsigned int dest_count = 0;
+
+static struct {
+	// main thread
+	_Atomic long int received, too_big, invalid, forwarded, send_errors, time_rtt_us, time_offset_us, time_freq_ppb;
+	// time sync thread
+	_Atomic long int time_requests, time_requests_unsynced;
+} stats;
+
+static void stats_dump(FILE *f) {
+	stat_print(f, "", stats, received);
+	stat_print(f, "", stats, too_big);
+	stat_print(f, "", stats, invalid);
+	stat_print(f, "", stats, forwarded);
+	stat_print(f, "", stats, send_errors);
+	stat_print(f, "", stats, time_rtt_us);
+	stat_print(f, "", stats, time_offset_us);
+	stat_print(f, "", stats, time_freq_ppb);
+	stat_print(f, "", stats, time_requests);
+	stat_print(f, "", stats, time_requests_unsynced);
+}
+
+// the relay keeps its own estimate of the source clock, and answers the time requests of the downstream receivers with it,
+// so that they end up synchronized to the source without any request having to go all the way up to it
+static struct time_sync time_sync;
+static struct timespec last_time_sent;
+
+static void *time_sync_thread(void *arg) {
+	printverbose("Time sync thread started\n");
+
+	int sock = *(int *)arg;
+
+	while (1) {
+		struct timep2 timepacket;
+		struct sockaddr_in addrin;
+		unsigned int addrinlen = sizeof(addrin);
+		memset(&addrin, 0, sizeof(addrin));
+
+		errno = 0;
+		int plen = recvfrom(sock, &timepacket, sizeof(struct timep), 0, (struct sockaddr *) &addrin, &addrinlen);
+		if (plen != sizeof(struct timep) || addrinlen != sizeof(addrin)) {
+			perror("recvfrom");
+			continue;
+		}
+
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		if (enable_time_sync) {
+			// until the first answer from the source, there is nothing meaningful to answer with
+			struct time_offset offset = {0, 0, 0, 0, 0};
+			time_sync_read(&time_sync, &offset);
+			if (offset.ref == 0) {
+				stat_inc(stats.time_requests_unsynced);
+				continue;
+			}
+			int64_t serv = (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+			serv += time_offset_at(&offset, serv);
+			now.tv_sec = serv / 1000000000;
+			now.tv_nsec = serv % 1000000000;
+		}
+		timepacket.t2.tv_sec = htobe64(now.tv_sec);
+		timepacket.t2.tv_nsec = htobe32(now.tv_nsec);
+
+		if (sendto(sock, &timepacket, sizeof(struct timep2), 0, (struct sockaddr *) &addrin, sizeof(addrin)) < 0) {
+			perror("sendto");
+		}
+		stat_inc(stats.time_requests);
+	}
+
+	pthread_exit(NULL);
+	return NULL;
+}
+
+static void time_reply_received(struct timep2 *timepacket, struct timespec *time_recv) {
+	if (last_time_sent.tv_sec == 0 || be64toh(timepacket->t1.tv_sec) != last_time_sent.tv_sec || be32toh(timepacket->t1.tv_nsec) != last_time_sent.tv_nsec) {
+		fprintf(stderr, "Invalid time packet received!\n");
+		stat_inc(stats.invalid);
+		return;
+	}
+	int64_t sent = (int64_t) last_time_sent.tv_sec * 1000000000 + last_time_sent.tv_nsec;
+	int64_t serv = (int64_t) be64toh(timepacket->t2.tv_sec) * 1000000000 + be32toh(timepacket->t2.tv_nsec);
+	int64_t recv = (int64_t) time_recv->tv_sec * 1000000000 + time_recv->tv_nsec;
+	time_sync_update(&time_sync, sent, serv, recv);
+
+	stat_set(stats.time_rtt_us, (recv - sent) / 1000);
+	stat_set(stats.time_offset_us, time_offset_at(&time_sync.published, recv) / 1000);
+	stat_set(stats.time_freq_ppb, lrint(time_sync.published.freq * 1e9));
+
+	printverbose("Time packet received! rtt = %"PRIi64", diff = %+011"PRIi64", freq = %+.3f ppm\n", recv - sent, time_offset_at(&time_sync.published, recv), time_sync.published.freq * 1e6);
+}
+
+int main(int argc, char *argv[]) {
+	fprintf(stderr, "mtrx relay - Forward audio via UDP unicast or multicast without decoding it\n");
+	fprintf(stderr, "Copyright (C) 2014-2017 Vittorio Gambaletta <openwrt@vittgam.net>\n\n");
+
+	while (1) {
+		int c = getopt(argc, argv, "h:p:o:O:n:S:T:v:");
+		if (c == -1) {
+			break;
+		} else if (c == 'h') {
+			addr = optarg;
+		} else if (c == 'p') {
+			port = strtoul(optarg, NULL, 10);
+		} else if (c == 'o') {
+			dests_list = optarg;
+		} else if (c == 'O') {
+			dests_file = optarg;
+		} else if (c == 'n') {
+			recv_batch = strtoul(optarg, NULL, 10);
+		} else if (c == 'S') {
+			stats_file = optarg;
+		} else if (c == 'T') {
+			enable_time_sync = strtoul(optarg, NULL, 10);
+		} else if (c == 'v') {
+			verbose = strtoul(optarg, NULL, 10);
+		} else {
+			fprintf(stderr, "\nUsage: mtrx relay [<options>]\n\n");
+			fprintf(stderr, "    -h <addr>   IP address to receive from (default: %s)\n", addr);
+			fprintf(stderr, "    -p <port>   UDP port (default: %lu)\n", port);
+			fprintf(stderr, "    -o <addrs>  Comma separated list of <addr>[:<port>] to forward to\n");
+			fprintf(stderr, "    -O <file>   Also forward to the addresses listed in file\n");
+			fprintf(stderr, "    -n <n>      Max packets forwarded per system call (default: %lu)\n", recv_batch);
+			fprintf(stderr, "    -S <file>   Write statistics to file every second\n");
+			fprintf(stderr, "    -T <n>      Synchronize to the source clock, or answer time requests with the local one (default: %lu)\n", enable_time_sync);
+			fprintf(stderr, "    -v <n>      Be verbose (default: %lu)\n", verbose);
+			fprintf(stderr, "\n");
+			exit(1);
+		}
+	}
+
+	struct sockaddr_in *sources = NULL;
+	unsigned int source_count = 0;
+	parse_destinations(addr, &sources, &source_count);
+	if (source_count != 1) {
+		fprintf(stderr, "Exactly one address to receive from must be given\n");
+		exit(1);
+	}
+	if (dests_list) {
+		parse_destinations(dests_list, &dests, &dest_count);
+	}
+	if (dests_file) {
+		parse_destinations_file(dests_file, &dests, &dest_count);
+	}
+	if (dest_count == 0) {
+		fprintf(stderr, "No destination addresses given\n");
+		exit(1);
+	}
+	if (recv_batch < 1) {
+		recv_batch = 1;
+	}
+
+	// the downstream socket is the one the receivers see the packets coming from, and so the one they send time requests to
+	int sock = init_socket(&sources[0]);
+	int sock_down = init_socket(NULL);
+	free(sources);
+
+	set_realtime_prio();
+
+	int ret;
+	pthread_t ths1;
+	pthread_attr_t thattr1;
+	pthread_attr_init(&thattr1);
+	pthread_attr_setdetachstate(&thattr1, PTHREAD_CREATE_DETACHED);
+	if ((ret = pthread_create(&ths1, &thattr1, time_sync_thread, (void *)&sock_down)) != 0) {
+		fprintf(stderr, "Error while calling pthread_create() for time sync thread: error %d (%s)\n", ret, strerror(ret));
+		exit(1);
+	}
+	pthread_attr_destroy(&thattr1);
+
+	drop_privs_if_needed();
+
+	if (stats_file) {
+		start_stats_thread(stats_file, stats_dump);
+	}
+
+	// every received packet is sent to every destination straight from the receive buffers, all with a single system call
+	struct mmsghdr *recv_msgs = alloca(recv_batch * sizeof(struct mmsghdr));
+	struct iovec *recv_iovs = alloca(recv_batch * sizeof(struct iovec));
+	struct sockaddr_in *recv_addrins = alloca(recv_batch * sizeof(struct sockaddr_in));
+	size_t recv_cmsg_size = CMSG_SPACE(sizeof(struct timespec));
+	char *recv_cmsgs = alloca(recv_batch * recv_cmsg_size);
+	size_t packet_size = sizeof(struct timep) + MAX_PAYLOAD_SIZE;
+	unsigned char *packets = malloc(recv_batch * packet_size);
+	struct mmsghdr *send_msgs = calloc(recv_batch * dest_count, sizeof(struct mmsghdr));
+	struct iovec *send_iovs = calloc(recv_batch, sizeof(struct iovec));
+	if (!packets || !send_msgs || !send_iovs) {
+		fprintf(stderr, "Could not allocate %lu bytes of memory!\n", (unsigned long int) (recv_batch * (packet_size + dest_count * sizeof(struct mmsghdr) + sizeof(struct iovec))));
+		exit(1);
+	}
+
+	while (1) {
+		for (unsigned int i = 0; i < recv_batch; i++) {
+			recv_iovs[i].iov_base = packets + i * packet_size;
+			recv_iovs[i].iov_len = packet_size;
+			memset(&recv_msgs[i], 0, sizeof(struct mmsghdr));
+			recv_msgs[i].msg_hdr.msg_name = &recv_addrins[i];
+			recv_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+			recv_msgs[i].msg_hdr.msg_iov = &recv_iovs[i];
+			recv_msgs[i].msg_hdr.msg_iovlen = 1;
+			recv_msgs[i].msg_hdr.msg_control = recv_cmsgs + i * recv_cmsg_size;
+			recv_msgs[i].msg_hdr.msg_controllen = recv_cmsg_size;
+		}
+
+		errno = 0;
+		int count = recvmmsg(sock, recv_msgs, recv_batch, MSG_WAITFORONE, NULL);
+		if (count <= 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("recvmmsg");
+			exit(1);
+		}
+
+		unsigned int send_count = 0;
+		for (unsigned int i = 0; i < count; i++) {
+			struct azzp *packet = recv_iovs[i].iov_base;
+			int plen = recv_msgs[i].msg_len;
+			if (plen <= (packet_is_compact(packet, plen) ? offsetof(struct hdrp, data) : sizeof(struct timep)) || recv_msgs[i].msg_hdr.msg_namelen != sizeof(struct sockaddr_in)) {
+				fprintf(stderr, "recvmmsg: invalid packet received (%d bytes)\n", plen);
+				stat_inc(stats.invalid);
+				continue;
+			}
+			if (recv_msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+				fprintf(stderr, "Received packet too big, dropping it\n");
+				stat_inc(stats.too_big);
+				continue;
+			}
+			stat_inc(stats.received);
+
+			struct timespec time_recv;
+			struct cmsghdr *cmsg;
+			for (cmsg = CMSG_FIRSTHDR(&recv_msgs[i].msg_hdr); cmsg; cmsg = CMSG_NXTHDR(&recv_msgs[i].msg_hdr, cmsg)) {
+				if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+					memcpy(&time_recv, CMSG_DATA(cmsg), sizeof(struct timespec));
+					break;
+				}
+			}
+			if (!cmsg) {
+				clock_gettime(CLOCK_REALTIME, &time_recv);
+			}
+
+			// answers to our own time requests are not forwarded, everything else is, parity packets and
+			// packets with the compact header included, whatever their length
+			if (plen == sizeof(struct timep2) && !packet_is_compact(packet, plen) && !(be32toh(packet->tv_nsec) & PARITY_FLAG)) {
+				time_reply_received((struct timep2 *) packet, &time_recv);
+				continue;
+			} else if (enable_time_sync && last_time_sent.tv_sec != time_recv.tv_sec) {
+				struct timep timepacket;
+				clock_gettime(CLOCK_REALTIME, &last_time_sent);
+				timepacket.tv_sec = htobe64(last_time_sent.tv_sec);
+				timepacket.tv_nsec = htobe32(last_time_sent.tv_nsec);
+				if (sendto(sock, &timepacket, sizeof(struct timep), 0, (struct sockaddr *) &recv_addrins[i], sizeof(struct sockaddr_in)) < 0) {
+					perror("sendto");
+				}
+			}
+
+			send_iovs[i].iov_base = packet;
+			send_iovs[i].iov_len = plen;
+			for (unsigned int j = 0; j < dest_count; j++) {
+				struct msghdr *msg = &send_msgs[send_count++].msg_hdr;
+				msg->msg_name = &dests[j];
+				msg->msg_namelen = sizeof(struct sockaddr_in);
+				msg->msg_iov = &send_iovs[i];
+				msg->msg_iovlen = 1;
+			}
+		}
+
+		unsigned int sent = 0;
+		while (sent < send_count) {
+			int ret = sendmmsg(sock_down, send_msgs + sent, send_count - sent, 0);
+			if (ret < 0) {
+				// don't let a single unreachable destination stop the others
+				if (errno == EINTR) {
+					continue;
+				}
+				struct sockaddr_in *dest = send_msgs[sent].msg_hdr.msg_name;
+				char addrstr[INET_ADDRSTRLEN];
+				inet_ntop(AF_INET, &dest->sin_addr, addrstr, sizeof(addrstr));
+				fprintf(stderr, "sendmmsg to %s:%u: %s\n", addrstr, ntohs(dest->sin_port), strerror(errno));
+				stat_inc(stats.send_errors);
+				ret = 1;
+			} else {
+				stat_add(stats.forwarded, ret);
+			}
+			sent += ret;
+		}
+	}
+
+	free(packets);
+	free(send_msgs);
+	free(send_iovs);
+	free(dests);
+
+	return 0;
+}